@@ -2,21 +2,309 @@
 * Doug - a take on 'du'
 *
 * Compilation:
-* clang++ -std=c++17 -O2 Doug.cpp -o doug (with added warnings)
+* clang++ -std=c++17 -O2 -pthread Doug.cpp -o doug (with added warnings)
 */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <fnmatch.h>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <queue>
+#include <string_view>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
 bool tackS = false;
+bool tackU = false;
+bool tackB = false;
+bool tackW = false;
+bool tackX = false;
+unsigned long tackJ = 1;
+long tackD = -1;
+unsigned long tackT = 0;
+bool tackStats = false;
+string tackStatsJson = "";
+string tackC = "";
+string tackSnapshot = "";
+// the two snapshots compared by --diff, older first
+string tackDiffOld = "";
+string tackDiffNew = "";
 const array<string, 5> sizeUnits { "B ", "KB", "MB", "GB", "TB" };
+// device of the starting path, the walk stays on it with -x
+dev_t startDevice = 0;
+
+// --exclude patterns, split by how cheaply they can be checked
+struct ExcludeMatcher {
+    // patterns without wildcards, kept sorted
+    vector<string> names;
+    // "name*" and "*name"
+    vector<string> prefixes;
+    vector<string> suffixes;
+    // anything else is left to fnmatch
+    vector<string> globs;
+    bool empty = true;
+};
+
+ExcludeMatcher excludes;
 
 struct Entry{
     filesystem::path path;
     uint64_t size;
+    uint64_t diskSize;
+};
+
+// apparent size and allocated disk usage, gathered in the same pass
+struct Sizes {
+    uint64_t apparent = 0;
+    uint64_t disk = 0;
+};
+
+Sizes& operator+=(Sizes& total, const Sizes& part)
+{
+    total.apparent += part.apparent;
+    total.disk += part.disk;
+    return total;
+}
+
+// hardlinked inodes already counted towards disk usage, one open addressing
+// table of inode numbers per device, where 0 marks an empty slot
+struct InodeTable {
+    uint64_t device;
+    vector<uint64_t> slots;
+    size_t count;
+};
+
+struct InodeShard {
+    mutex lock;
+    vector<InodeTable> tables;
+};
+
+// the shard comes from the top bits of the hash and the slot from the
+// low bits, so both use the whole hash
+const unsigned inodeShardBits = 6;
+const size_t inodeShards = size_t(1) << inodeShardBits;
+array<InodeShard, inodeShards> seenInodes;
+
+// size cache record for one directory, the totals only cover the entries
+// directly inside it and are trusted while its mtime and ctime are unchanged
+struct CacheRecord {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t ctimeSec;
+    int64_t ctimeNsec;
+    uint64_t apparent;
+    uint64_t disk;
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint64_t version;
+    // totals depend on --exclude and -x, so a cache is only reused with the same
+    uint64_t settings;
+    uint64_t count;
+};
+
+const char cacheMagic[8] = { 'D', 'O', 'U', 'G', 'C', 'A', 'C', 'H' };
+const uint64_t cacheVersion = 3;
+
+// the previous run's records, mapped read only and sorted by device and inode
+const CacheRecord* cachedRecords = nullptr;
+size_t cachedCount = 0;
+// records for this run, written out once the walk is done
+vector<CacheRecord> freshRecords;
+mutex freshLock;
+
+// one directory of a snapshot, in path order. its path relative to the
+// scanned one is the first shared bytes of the previous record's path
+// followed by the next suffixLength bytes of the names
+struct SnapshotRecord {
+    uint32_t shared;
+    uint32_t suffixLength;
+    uint64_t apparent;
+    uint64_t disk;
+};
+
+// followed by the records, then the scanned path and every suffix
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t count;
+    uint64_t namesSize;
+    uint64_t rootLength;
+};
+
+const char snapshotMagic[8] = { 'D', 'O', 'U', 'G', 'S', 'N', 'A', 'P' };
+const uint64_t snapshotVersion = 1;
+
+// a snapshot file mapped read only
+struct Snapshot {
+    const SnapshotHeader* header;
+    const SnapshotRecord* records;
+    const char* names;
+};
+
+// position in a snapshot, with the current record's path rebuilt in place
+struct SnapshotCursor {
+    const Snapshot* snapshot;
+    size_t index;
+    size_t nameOffset;
+    const SnapshotRecord* record;
+    string path;
+};
+
+// directories reported by --diff without -t
+const size_t diffDefault = 20;
+
+// record layout returned by getdents64
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+
+const size_t direntBufferSize = 64 * 1024;
+alignas(8) thread_local char direntBuffer[direntBufferSize];
+
+// an open directory, closed once its last queued child has been opened
+struct DirectoryHandle {
+    int fd;
+    explicit DirectoryHandle(int dirFd) : fd(dirFd) {}
+    DirectoryHandle(const DirectoryHandle&) = delete;
+    ~DirectoryHandle() { close(fd); }
+};
+
+// a directory still to be scanned by the parallel walker
+struct WorkItem {
+    // top level items have no parent and carry their full path as name
+    shared_ptr<DirectoryHandle> parent;
+    string name;
+    // the top level entry its size is added to
+    size_t entryIndex;
+    size_t node;
+    unsigned long depth;
+};
+
+struct WorkQueue {
+    mutex lock;
+    deque<WorkItem> items;
+};
+
+// a directory in the flat report tree built for -d and -t, children always
+// come after their parent and names are slices of one shared arena
+struct TreeNode {
+    uint32_t parent;
+    uint32_t nameLength;
+    uint64_t nameOffset;
+    // the directory's own entries until the walk ends, then its subtree
+    Sizes total;
+};
+
+struct Tree {
+    vector<TreeNode> nodes;
+    string names;
+    mutex lock;
+};
+
+const size_t noNode = SIZE_MAX;
+Tree tree;
+
+// a directory in the live tree kept by watch mode, node 0 is the root
+struct WatchNode {
+    size_t parent = 0;
+    string name;
+    Sizes direct;
+    Sizes total;
+    vector<size_t> children;
+    int wd = -1;
+    string handle;
+    bool alive = false;
+    bool dirty = false;
+};
+
+struct Watch {
+    vector<WatchNode> nodes;
+    vector<size_t> freeNodes;
+    vector<size_t> dirty;
+    unordered_map<int, size_t> byWatch;
+    // keyed by filesystem id and handle, since handles are only unique
+    // within one filesystem
+    unordered_map<string, size_t> byHandle;
+    // each filesystem reached and whether a fanotify mark covers it,
+    // directories on the others are watched through inotify
+    vector<pair<dev_t, bool>> devices;
+    int fanotifyFd = -1;
+    int inotifyFd = -1;
+    bool warned = false;
+};
+
+const uint64_t fanotifyEvents = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | 
+    FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+
+const chrono::seconds watchInterval(2);
+
+// syscall and traversal counters, plain thread local increments so they can
+// stay on all the time, merged into statsTotal as threads finish
+struct Counters {
+    uint64_t entries = 0;
+    uint64_t stats = 0;
+    uint64_t opens = 0;
+    uint64_t getdents = 0;
+    uint64_t maxDepth = 0;
+    uint64_t maxFanout = 0;
+};
+
+struct PhaseTiming {
+    string name;
+    double wall;
+    double cpu;
+};
+
+thread_local Counters counters;
+Counters statsTotal;
+mutex statsLock;
+vector<PhaseTiming> phases;
+
+struct Walker {
+    vector<WorkQueue> queues;
+    // per thread running totals for each top level entry
+    vector<vector<Sizes>> sizes;
+    atomic<uint64_t> pending{0};
+    // items sitting in the queues, changed under the queue's lock
+    atomic<uint64_t> queued{0};
+    // threads with nothing to take sleep here until items are queued
+    // or the walk ends
+    mutex idleLock;
+    condition_variable wake;
+    atomic<size_t> idle{0};
 };
 
 void printUsage(string errorType, string problem)
@@ -25,12 +313,167 @@ void printUsage(string errorType, string problem)
         cerr << "ERROR: Unrecognized flag \"" << problem << "\"\n";
     else if(errorType == "badPath")
         cerr << "ERROR: Unrecognized path \"" << problem << "\"\n";
-    cout << "Usage: doug [-hs] [path]\n";
+    cout << "Usage: doug [-bhsuwx] [-c file] [-d n] [-j n] [-t n] [--exclude pattern] "
+        << "[--stats] [--stats-json file] [--snapshot file] [--diff old new] [path]\n";
+    cout << "   -b : show both apparent size and disk usage\n";
+    cout << "   -c file : reuse and update a size cache\n";
+    cout << "   -d n : show directories up to n levels deep\n";
     cout << "   -h : show help\n";
+    cout << "   -j n : scan with n threads\n";
     cout << "   -s : sort by size\n";
+    cout << "   -t n : show the n largest directories at any depth\n";
+    cout << "   -u : show disk usage, counting hardlinks once\n";
+    cout << "   -w : keep watching and reprint as sizes change\n";
+    cout << "   -x : stay on the filesystem of path\n";
+    cout << "   --exclude pattern : skip entries whose name matches pattern\n";
+    cout << "   --stats : print phase timings and syscall counts to stderr\n";
+    cout << "   --stats-json file : write phase timings and syscall counts as JSON\n";
+    cout << "   --snapshot file : save the total of every directory to file\n";
+    cout << "   --diff old new : show the directories that grew most between two snapshots\n";
     exit((errorType == "") ? 0 : 1);
 }
 
+bool isNumeric(string input) {
+    for (unsigned long i = 0; i < input.length(); i++)
+    {
+        if (!isdigit(input[i]))
+            return false;
+    }
+    return !input.empty();
+}
+
+int setFlags(int argc, int arg, char** argv)
+{
+    for(string::size_type charIndex = 1; 
+        charIndex < string(argv[arg]).length(); charIndex++)
+    {
+        if(argv[arg][charIndex] == 'h')
+            printUsage("", "");
+        else if(argv[arg][charIndex] == 's')
+            tackS = true;
+        else if(argv[arg][charIndex] == 'u')
+            tackU = true;
+        else if(argv[arg][charIndex] == 'b')
+            tackB = true;
+        else if(argv[arg][charIndex] == 'w')
+            tackW = true;
+        else if(argv[arg][charIndex] == 'x')
+            tackX = true;
+        else if(argv[arg][charIndex] == 'j')
+        {
+            if(arg + 1 >= argc || !isNumeric(argv[arg + 1]))
+                printUsage("badFlag", (arg + 1 < argc) ? argv[arg + 1] : "j");
+            tackJ = max(1UL, stoul(argv[++arg]));
+            break;
+        }
+        else if(argv[arg][charIndex] == 'd' || argv[arg][charIndex] == 't')
+        {
+            if(arg + 1 >= argc || !isNumeric(argv[arg + 1]))
+                printUsage("badFlag", (arg + 1 < argc) ? argv[arg + 1] : 
+                    string(1, argv[arg][charIndex]));
+            if(argv[arg][charIndex] == 'd')
+                tackD = stol(argv[++arg]);
+            else
+                tackT = stoul(argv[++arg]);
+            break;
+        }
+        else if(argv[arg][charIndex] == 'c')
+        {
+            if(arg + 1 >= argc)
+                printUsage("badFlag", "c");
+            tackC = argv[++arg];
+            break;
+        }
+        else
+            printUsage("badFlag", string(1, argv[arg][charIndex]));
+    }
+    return arg;
+}
+
+bool hasWildcard(const string& text)
+{
+    return text.find_first_of("*?[\\") != string::npos;
+}
+
+void addExclude(const string& pattern)
+{
+    excludes.empty = false;
+    if(!hasWildcard(pattern))
+    {
+        excludes.names.push_back(pattern);
+        sort(excludes.names.begin(), excludes.names.end());
+    }
+    else if(pattern.size() > 1 && pattern.back() == '*' && 
+        !hasWildcard(pattern.substr(0, pattern.size() - 1)))
+        excludes.prefixes.push_back(pattern.substr(0, pattern.size() - 1));
+    else if(pattern.size() > 1 && pattern.front() == '*' && 
+        !hasWildcard(pattern.substr(1)))
+        excludes.suffixes.push_back(pattern.substr(1));
+    else
+        excludes.globs.push_back(pattern);
+}
+
+bool isExcluded(const char* name)
+{
+    if(excludes.empty)
+        return false;
+    const string_view text(name);
+    if(binary_search(excludes.names.begin(), excludes.names.end(), text))
+        return true;
+    for(const auto& prefix : excludes.prefixes)
+    {
+        if(text.compare(0, prefix.size(), prefix) == 0)
+            return true;
+    }
+    for(const auto& suffix : excludes.suffixes)
+    {
+        if(text.size() >= suffix.size() && 
+            text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0)
+            return true;
+    }
+    for(const auto& glob : excludes.globs)
+    {
+        if(fnmatch(glob.c_str(), name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+int setLongFlag(int argc, int arg, char** argv)
+{
+    const string flag = argv[arg];
+    if(flag == "--stats")
+        tackStats = true;
+    else if(flag == "--exclude")
+    {
+        if(arg + 1 >= argc)
+            printUsage("badFlag", flag);
+        addExclude(argv[++arg]);
+    }
+    else if(flag == "--stats-json")
+    {
+        if(arg + 1 >= argc)
+            printUsage("badFlag", flag);
+        tackStatsJson = argv[++arg];
+    }
+    else if(flag == "--snapshot")
+    {
+        if(arg + 1 >= argc)
+            printUsage("badFlag", flag);
+        tackSnapshot = argv[++arg];
+    }
+    else if(flag == "--diff")
+    {
+        if(arg + 2 >= argc)
+            printUsage("badFlag", flag);
+        tackDiffOld = argv[++arg];
+        tackDiffNew = argv[++arg];
+    }
+    else
+        printUsage("badFlag", flag);
+    return arg;
+}
+
 int getFlags(int argc, char** argv)
 {
     // if no arguments
@@ -40,19 +483,13 @@ int getFlags(int argc, char** argv)
     {
         for(int arg = 1; arg < argc; arg++)
         {
-            if(argv[arg][0] == '-')
+            if(argv[arg][0] == '-' && argv[arg][1] == '-')
+            {
+                arg = setLongFlag(argc, arg, argv);
+            }
+            else if(argv[arg][0] == '-')
             {
-                // set flags from arguments beginning with '-'
-                for(string::size_type charIndex = 1; 
-                    charIndex < string(argv[arg]).length(); charIndex++)
-                {
-                    if(argv[arg][charIndex] == 'h')
-                        printUsage("", "");
-                    else if(argv[arg][charIndex] == 's')
-                        tackS = true;
-                    else
-                        printUsage("badFlag", string(1, argv[arg][charIndex]));
-                }
+                arg = setFlags(argc, arg, argv);
             }
             // return index of first non '-' argument
             else
@@ -62,73 +499,694 @@ int getFlags(int argc, char** argv)
     }
 }
 
-uint64_t getDirectorySize(const filesystem::path& path)
+int openDirectory(int parentFd, const char* name, bool follow = false)
+{
+    counters.opens++;
+    const int dirFd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | 
+        O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+    if(dirFd < 0)
+        cerr << "ERROR: Could not open \"" << name << "\": " 
+            << strerror(errno) << "\n";
+    return dirFd;
+}
+
+bool isDotEntry(const char* name)
+{
+    return name[0] == '.' && 
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// -x keeps the walk on the starting filesystem, using the caller's stat
+// when it already has one
+bool onStartDevice(int dirFd, const char* name, const struct stat* info)
 {
-    uint64_t totalSize = 0;
-    for(const auto& file : filesystem::directory_iterator(path))
+    if(!tackX)
+        return true;
+    struct stat own;
+    if(info == nullptr)
     {
-        if(filesystem::is_directory(file.path()))
-            totalSize += getDirectorySize(file.path());
-        else if(filesystem::is_symlink(file.path()))
+        counters.stats++;
+        if(fstatat(dirFd, name, &own, AT_SYMLINK_NOFOLLOW) != 0)
+            return false;
+        info = &own;
+    }
+    return info->st_dev == startDevice;
+}
+
+uint64_t hashInode(uint64_t inode)
+{
+    uint64_t hash = inode * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 32);
+}
+
+void insertSlot(vector<uint64_t>& slots, uint64_t hash, uint64_t inode)
+{
+    const size_t mask = slots.size() - 1;
+    size_t index = hash & mask;
+    while(slots[index] != 0)
+        index = (index + 1) & mask;
+    slots[index] = inode;
+}
+
+// returns true the first time a (device, inode) pair is seen
+bool firstLink(uint64_t device, uint64_t inode)
+{
+    const uint64_t hash = hashInode(inode ^ (device << 40));
+    InodeShard& shard = seenInodes[hash >> (64 - inodeShardBits)];
+    lock_guard<mutex> guard(shard.lock);
+    auto table = find_if(shard.tables.begin(), shard.tables.end(), 
+        [device](const InodeTable& t) { return t.device == device; });
+    if(table == shard.tables.end())
+    {
+        shard.tables.push_back(InodeTable{device, vector<uint64_t>(64, 0), 0});
+        table = shard.tables.end() - 1;
+    }
+    const size_t mask = table->slots.size() - 1;
+    for(size_t index = hash & mask; table->slots[index] != 0; 
+        index = (index + 1) & mask)
+    {
+        if(table->slots[index] == inode)
+            return false;
+    }
+    // keep the load factor under 3/4, rehashing into twice the slots
+    if((table->count + 1) * 4 > table->slots.size() * 3)
+    {
+        vector<uint64_t> grown(table->slots.size() * 2, 0);
+        for(const uint64_t old : table->slots)
+        {
+            if(old != 0)
+                insertSlot(grown, hashInode(old ^ (device << 40)), old);
+        }
+        table->slots.swap(grown);
+    }
+    insertSlot(table->slots, hash, inode);
+    table->count++;
+    return true;
+}
+
+uint64_t diskUsage(const struct stat& info)
+{
+    // st_blocks is always in 512 byte units
+    return static_cast<uint64_t>(info.st_blocks) * 512;
+}
+
+uint64_t cacheSettings()
+{
+    string settings = tackX ? "x" : "";
+    for(const auto* group : { &excludes.names, &excludes.prefixes, 
+        &excludes.suffixes, &excludes.globs })
+    {
+        for(const auto& pattern : *group)
+            settings += "\n" + pattern;
+        settings += "\n";
+    }
+    return hash<string>()(settings);
+}
+
+void loadCache()
+{
+    const int cacheFd = open(tackC.c_str(), O_RDONLY | O_CLOEXEC);
+    if(cacheFd < 0)
+        return;
+    struct stat info;
+    if(fstat(cacheFd, &info) != 0 || 
+        static_cast<size_t>(info.st_size) < sizeof(CacheHeader))
+    {
+        close(cacheFd);
+        return;
+    }
+    const auto fileSize = static_cast<size_t>(info.st_size);
+    void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, cacheFd, 0);
+    close(cacheFd);
+    if(mapped == MAP_FAILED)
+        return;
+    const auto* header = static_cast<const CacheHeader*>(mapped);
+    // a stale or foreign file is ignored and rewritten at the end of the run
+    if(memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0 || 
+        header->version != cacheVersion || header->settings != cacheSettings() || 
+        fileSize != sizeof(CacheHeader) + header->count * sizeof(CacheRecord))
+    {
+        munmap(mapped, fileSize);
+        return;
+    }
+    cachedRecords = reinterpret_cast<const CacheRecord*>(header + 1);
+    cachedCount = header->count;
+}
+
+bool recordBefore(const CacheRecord& r1, const CacheRecord& r2)
+{
+    return (r1.device != r2.device) ? (r1.device < r2.device) : 
+        (r1.inode < r2.inode);
+}
+
+const CacheRecord* findCached(const struct stat& info)
+{
+    CacheRecord key{};
+    key.device = info.st_dev;
+    key.inode = info.st_ino;
+    const CacheRecord* end = cachedRecords + cachedCount;
+    const CacheRecord* found = lower_bound(cachedRecords, end, key, recordBefore);
+    if(found == end || found->device != key.device || found->inode != key.inode)
+        return nullptr;
+    if(found->mtimeSec != info.st_mtim.tv_sec || 
+        found->mtimeNsec != info.st_mtim.tv_nsec || 
+        found->ctimeSec != info.st_ctim.tv_sec || 
+        found->ctimeNsec != info.st_ctim.tv_nsec)
+        return nullptr;
+    return found;
+}
+
+void rememberDirectory(const struct stat& info, const Sizes& direct)
+{
+    const CacheRecord record{ info.st_dev, info.st_ino, 
+        info.st_mtim.tv_sec, info.st_mtim.tv_nsec, 
+        info.st_ctim.tv_sec, info.st_ctim.tv_nsec, 
+        direct.apparent, direct.disk };
+    lock_guard<mutex> guard(freshLock);
+    freshRecords.push_back(record);
+}
+
+void saveCache()
+{
+    sort(freshRecords.begin(), freshRecords.end(), recordBefore);
+    CacheHeader header{};
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.settings = cacheSettings();
+    header.count = freshRecords.size();
+    // written beside the old cache and renamed over it, which stays mapped
+    const string temporary = tackC + ".tmp";
+    ofstream file(temporary, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(freshRecords.data()), 
+        static_cast<streamsize>(freshRecords.size() * sizeof(CacheRecord)));
+    file.close();
+    if(!file || rename(temporary.c_str(), tackC.c_str()) != 0)
+        cerr << "ERROR: Could not write cache \"" << tackC << "\"\n";
+}
+
+// calls visit for every entry in a directory except . and ..
+template<typename Visit>
+void readDirectory(int dirFd, Visit visit)
+{
+    uint64_t fanout = 0;
+    while(true)
+    {
+        // errors end the listing the same way as reaching the end
+        counters.getdents++;
+        const long bytes = syscall(SYS_getdents64, dirFd, direntBuffer, 
+            direntBufferSize);
+        if(bytes <= 0)
+            break;
+        for(long offset = 0; offset < bytes;)
+        {
+            const auto* entry = 
+                reinterpret_cast<const LinuxDirent64*>(direntBuffer + offset);
+            offset += entry->d_reclen;
+            if(isDotEntry(entry->d_name))
+                continue;
+            fanout++;
+            visit(*entry);
+        }
+    }
+    counters.entries += fanout;
+    counters.maxFanout = max(counters.maxFanout, fanout);
+}
+
+// a cached directory only needs its subdirectories, which d_type
+// gives without a stat on most filesystems
+void listSubdirectories(int dirFd, vector<string>& subdirectories)
+{
+    struct stat info;
+    readDirectory(dirFd, [&](const LinuxDirent64& entry) {
+        if(isExcluded(entry.d_name))
+            return;
+        if(entry.d_type == DT_DIR)
+        {
+            if(onStartDevice(dirFd, entry.d_name, nullptr))
+                subdirectories.emplace_back(entry.d_name);
+        }
+        else if(entry.d_type == DT_UNKNOWN)
+        {
+            counters.stats++;
+            if(fstatat(dirFd, entry.d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && 
+                S_ISDIR(info.st_mode) && onStartDevice(dirFd, entry.d_name, &info))
+                subdirectories.emplace_back(entry.d_name);
+        }
+    });
+}
+
+// sums the regular files directly inside a directory and collects the names
+// of its subdirectories, shared by the serial and parallel walks so both
+// count the same entries. d_type saves the stat for anything but regular
+// files, and symlinks are never followed
+Sizes scanDirectory(int dirFd, vector<string>& subdirectories)
+{
+    Sizes totalSize;
+    const bool useCache = (tackC != "");
+    // the cache always records disk usage so any later run can use it
+    const bool countDisk = tackU || tackB || useCache;
+    struct stat directoryInfo;
+    bool haveInfo = false;
+    if(countDisk)
+    {
+        counters.stats++;
+        haveInfo = (fstat(dirFd, &directoryInfo) == 0);
+    }
+    if(useCache && haveInfo)
+    {
+        const CacheRecord* cached = findCached(directoryInfo);
+        if(cached != nullptr)
+        {
+            listSubdirectories(dirFd, subdirectories);
+            totalSize.apparent = cached->apparent;
+            totalSize.disk = cached->disk;
+            rememberDirectory(directoryInfo, totalSize);
+            return totalSize;
+        }
+    }
+    // the directory's own blocks count towards its disk usage
+    if(haveInfo)
+        totalSize.disk += diskUsage(directoryInfo);
+    struct stat info;
+    // hardlinked files are only counted by whichever directory sees them
+    // first, which a cached total cannot take part in
+    bool hasLinks = false;
+    readDirectory(dirFd, [&](const LinuxDirent64& entry) {
+        // excluded subtrees cost this one name check
+        if(isExcluded(entry.d_name))
+            return;
+        if(entry.d_type == DT_DIR)
+        {
+            if(onStartDevice(dirFd, entry.d_name, nullptr))
+                subdirectories.emplace_back(entry.d_name);
+        }
+        else if(entry.d_type == DT_REG || entry.d_type == DT_UNKNOWN)
+        {
+            counters.stats++;
+            if(fstatat(dirFd, entry.d_name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                return;
+            if(S_ISREG(info.st_mode))
+            {
+                totalSize.apparent += static_cast<uint64_t>(info.st_size);
+                hasLinks = hasLinks || info.st_nlink > 1;
+                // only inodes with several links need remembering, watch
+                // mode rescans directories so it counts every link
+                if(countDisk && (info.st_nlink < 2 || tackW || 
+                    firstLink(info.st_dev, info.st_ino)))
+                    totalSize.disk += diskUsage(info);
+            }
+            else if(S_ISDIR(info.st_mode) && onStartDevice(dirFd, entry.d_name, &info))
+                subdirectories.emplace_back(entry.d_name);
+        }
+    });
+    if(useCache && haveInfo && !hasLinks)
+        rememberDirectory(directoryInfo, totalSize);
+    return totalSize;
+}
+
+// stores a scanned directory's own sizes and appends its subdirectories
+// as one contiguous run of nodes, returning the first one
+size_t recordDirectory(size_t node, const Sizes& direct, 
+    const vector<string>& subdirectories)
+{
+    if(node == noNode)
+        return noNode;
+    lock_guard<mutex> guard(tree.lock);
+    tree.nodes[node].total = direct;
+    const size_t firstChild = tree.nodes.size();
+    for(const auto& name : subdirectories)
+    {
+        tree.nodes.push_back(TreeNode{ static_cast<uint32_t>(node), 
+            static_cast<uint32_t>(name.size()), tree.names.size(), Sizes() });
+        tree.names += name;
+    }
+    return firstChild;
+}
+
+Sizes getDirectorySize(int dirFd, size_t node, unsigned long depth)
+{
+    counters.maxDepth = max<uint64_t>(counters.maxDepth, depth);
+    vector<string> subdirectories;
+    Sizes totalSize = scanDirectory(dirFd, subdirectories);
+    const size_t firstChild = recordDirectory(node, totalSize, subdirectories);
+    for(size_t i = 0; i < subdirectories.size(); i++)
+    {
+        const int childFd = openDirectory(dirFd, subdirectories[i].c_str());
+        if(childFd < 0)
             continue;
-        else
-            totalSize += filesystem::file_size(file);
+        totalSize += getDirectorySize(childFd, 
+            (firstChild == noNode) ? noNode : firstChild + i, depth + 1);
+        close(childFd);
     }
     return totalSize;
 }
 
-void fillEntryVector(vector<Entry>& entries, string path)
+void mergeCounters()
+{
+    lock_guard<mutex> guard(statsLock);
+    statsTotal.entries += counters.entries;
+    statsTotal.stats += counters.stats;
+    statsTotal.opens += counters.opens;
+    statsTotal.getdents += counters.getdents;
+    statsTotal.maxDepth = max(statsTotal.maxDepth, counters.maxDepth);
+    statsTotal.maxFanout = max(statsTotal.maxFanout, counters.maxFanout);
+    counters = Counters();
+}
+
+double cpuSeconds()
+{
+    // process wide, so parallel phases report the CPU of every thread
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+}
+
+template<typename Work>
+void timePhase(const char* name, Work work)
+{
+    if(!tackStats && tackStatsJson == "")
+    {
+        work();
+        return;
+    }
+    const auto wallStart = chrono::steady_clock::now();
+    const double cpuStart = cpuSeconds();
+    work();
+    phases.push_back(PhaseTiming{ name, chrono::duration<double>(
+        chrono::steady_clock::now() - wallStart).count(), cpuSeconds() - cpuStart });
+}
+
+void printStats()
+{
+    mergeCounters();
+    double wall = 0;
+    for(const auto& phase : phases)
+        wall += phase.wall;
+    const double entriesPerSecond = (wall > 0) ? 
+        static_cast<double>(statsTotal.entries) / wall : 0;
+    if(tackStats)
+    {
+        cerr << left << setw(18) << "phase" << right << setw(10) << "wall(s)" 
+            << setw(10) << "cpu(s)" << "\n";
+        for(const auto& phase : phases)
+        {
+            cerr << left << setw(18) << phase.name << right << fixed 
+                << setprecision(3) << setw(10) << phase.wall << setw(10) 
+                << phase.cpu << "\n";
+        }
+        cerr << "entries        : " << statsTotal.entries << " (" << setprecision(0) 
+            << entriesPerSecond << "/s)\n";
+        cerr << "stat calls     : " << statsTotal.stats << "\n";
+        cerr << "open calls     : " << statsTotal.opens << "\n";
+        cerr << "getdents calls : " << statsTotal.getdents << "\n";
+        cerr << "deepest level  : " << statsTotal.maxDepth << "\n";
+        cerr << "largest fanout : " << statsTotal.maxFanout << "\n";
+    }
+    if(tackStatsJson == "")
+        return;
+    ofstream json(tackStatsJson);
+    json << "{\"phases\":[";
+    for(size_t i = 0; i < phases.size(); i++)
+    {
+        json << ((i == 0) ? "" : ",") << "{\"name\":\"" << phases[i].name 
+            << "\",\"wall\":" << phases[i].wall << ",\"cpu\":" << phases[i].cpu << "}";
+    }
+    json << "],\"entries\":" << statsTotal.entries 
+        << ",\"entriesPerSecond\":" << fixed << setprecision(0) << entriesPerSecond 
+        << ",\"stat\":" << statsTotal.stats << ",\"open\":" << statsTotal.opens 
+        << ",\"getdents\":" << statsTotal.getdents 
+        << ",\"maxDepth\":" << statsTotal.maxDepth 
+        << ",\"maxFanout\":" << statsTotal.maxFanout << "}\n";
+    if(!json)
+        cerr << "ERROR: Could not write stats \"" << tackStatsJson << "\"\n";
+}
+
+bool takeWork(Walker& walker, size_t self, WorkItem& item)
+{
+    // own queue is used depth first from the back
+    {
+        WorkQueue& own = walker.queues[self];
+        lock_guard<mutex> guard(own.lock);
+        if(!own.items.empty())
+        {
+            item = move(own.items.back());
+            own.items.pop_back();
+            walker.queued--;
+            return true;
+        }
+    }
+    // otherwise steal the oldest, usually largest, item from another thread
+    for(size_t offset = 1; offset < walker.queues.size(); offset++)
+    {
+        WorkQueue& victim = walker.queues[(self + offset) % walker.queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if(!victim.items.empty())
+        {
+            item = move(victim.items.front());
+            victim.items.pop_front();
+            walker.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the lock is taken so a thread between checking and sleeping cannot miss it
+void wakeIdle(Walker& walker)
+{
+    if(walker.idle.load() == 0)
+        return;
+    {
+        lock_guard<mutex> guard(walker.idleLock);
+    }
+    walker.wake.notify_all();
+}
+
+void waitForWork(Walker& walker)
 {
-    for(const auto& file : filesystem::directory_iterator(path))
+    unique_lock<mutex> guard(walker.idleLock);
+    walker.idle++;
+    walker.wake.wait(guard, [&] { 
+        return walker.queued.load() > 0 || walker.pending.load() == 0; });
+    walker.idle--;
+}
+
+void retireItem(Walker& walker)
+{
+    if(--walker.pending == 0)
+        wakeIdle(walker);
+}
+
+void walkDirectories(Walker& walker, size_t self)
+{
+    vector<string> subdirectories;
+    WorkItem item;
+    while(walker.pending.load() > 0)
     {
-        if(file.is_directory())
+        if(!takeWork(walker, self, item))
         {
-            Entry temp = {file.path(), 0};
-            entries.push_back(temp);
+            waitForWork(walker);
+            continue;
         }
+        const int dirFd = openDirectory(
+            item.parent ? item.parent->fd : AT_FDCWD, item.name.c_str());
+        item.parent.reset();
+        if(dirFd < 0)
+        {
+            retireItem(walker);
+            continue;
+        }
+        auto handle = make_shared<DirectoryHandle>(dirFd);
+        counters.maxDepth = max<uint64_t>(counters.maxDepth, item.depth);
+        subdirectories.clear();
+        const Sizes direct = scanDirectory(dirFd, subdirectories);
+        walker.sizes[self][item.entryIndex] += direct;
+        const size_t firstChild = recordDirectory(item.node, direct, 
+            subdirectories);
+        // children are counted before the parent is retired,
+        // so pending only reaches zero once the whole tree is done
+        walker.pending += subdirectories.size();
+        {
+            WorkQueue& own = walker.queues[self];
+            lock_guard<mutex> guard(own.lock);
+            for(size_t i = 0; i < subdirectories.size(); i++)
+                own.items.push_back(WorkItem{ handle, move(subdirectories[i]), 
+                    item.entryIndex, (firstChild == noNode) ? noNode : firstChild + i, 
+                    item.depth + 1 });
+            walker.queued += subdirectories.size();
+        }
+        if(!subdirectories.empty())
+            wakeIdle(walker);
+        retireItem(walker);
     }
+    mergeCounters();
+}
+
+void fillEntryVector(vector<Entry>& entries, string path)
+{
+    // the given path may itself be a symlink
+    const int dirFd = openDirectory(AT_FDCWD, path.c_str(), true);
+    if(dirFd < 0)
+        return;
+    vector<string> subdirectories;
+    listSubdirectories(dirFd, subdirectories);
+    close(dirFd);
+    // top level entries become nodes 1 to n under the root
+    recordDirectory(tree.nodes.empty() ? noNode : 0, Sizes(), subdirectories);
+    for(const auto& name : subdirectories)
+        entries.push_back(Entry{filesystem::path(path) / name, 0, 0});
+}
+
+Sizes getFileSizes(string path)
+{
+    // the given path may itself be a symlink
+    const int dirFd = openDirectory(AT_FDCWD, path.c_str(), true);
+    if(dirFd < 0)
+        return Sizes();
+    vector<string> subdirectories;
+    const Sizes totalSize = scanDirectory(dirFd, subdirectories);
+    close(dirFd);
+    return totalSize;
 }
 
-uint64_t getFileSizes(string path)
+Sizes sumSubdirectorySizesParallel(vector<Entry>& entries)
 {
-    uint64_t totalSize = 0;
-    for(const auto& file : filesystem::directory_iterator(path))
+    // queued directories keep their parent open, so allow as many fds as we can
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    Walker walker;
+    walker.queues = vector<WorkQueue>(tackJ);
+    walker.sizes.assign(tackJ, vector<Sizes>(entries.size()));
+    walker.pending = entries.size();
+    walker.queued = entries.size();
+    for(size_t i = 0; i < entries.size(); i++)
+        walker.queues[i % tackJ].items.push_back(
+            WorkItem{ nullptr, entries[i].path.string(), i, 
+                tree.nodes.empty() ? noNode : i + 1, 1 });
+    vector<thread> workers;
+    for(size_t self = 0; self < tackJ; self++)
+        workers.emplace_back(walkDirectories, ref(walker), self);
+    for(auto& worker : workers)
+        worker.join();
+    Sizes totalSize;
+    for(size_t i = 0; i < entries.size(); i++)
     {
-        if(file.is_regular_file())
-            totalSize += filesystem::file_size(file);
+        Sizes entrySize;
+        for(const auto& threadSizes : walker.sizes)
+            entrySize += threadSizes[i];
+        entries[i].size = entrySize.apparent;
+        entries[i].diskSize = entrySize.disk;
+        totalSize += entrySize;
     }
     return totalSize;
 }
 
-uint64_t sumSubdirectorySizes(vector<Entry>& entries)
+Sizes sumSubdirectorySizes(vector<Entry>& entries)
 {
-    uint64_t totalSize = 0;
-    for(auto& entry : entries)
+    if(tackJ > 1)
+        return sumSubdirectorySizesParallel(entries);
+    Sizes totalSize;
+    for(size_t i = 0; i < entries.size(); i++)
     {
-        entry.size = getDirectorySize(entry.path);
-        totalSize += entry.size;
+        Entry& entry = entries[i];
+        const int dirFd = openDirectory(AT_FDCWD, entry.path.c_str());
+        if(dirFd < 0)
+            continue;
+        const Sizes entrySize = getDirectorySize(dirFd, 
+            tree.nodes.empty() ? noNode : i + 1, 1);
+        close(dirFd);
+        entry.size = entrySize.apparent;
+        entry.diskSize = entrySize.disk;
+        totalSize += entrySize;
     }
     return totalSize;
 }
 
-bool alphabeticSort(const Entry& e1, const Entry& e2) 
+// a name folded to lowercase once into the arena, with the directory
+// bit and its first bytes packed into prefix, so most comparisons are
+// a single integer compare
+struct SortKey {
+    uint64_t prefix;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t index;
+};
+
+// bytes of the folded name held in the key, below the directory bit
+const size_t keyBytes = 7;
+
+// returns the indices of count names in case-insensitive order, with any
+// isLater ones after the rest, the order the old tolower'd copies gave
+template<typename Name, typename IsLater>
+vector<uint32_t> sortOrder(size_t count, Name name, IsLater isLater)
+{
+    string arena;
+    vector<SortKey> keys(count);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        const auto text = name(i);
+        SortKey& key = keys[i];
+        key.prefix = isLater(i) ? (1ULL << 63) : 0;
+        key.offset = static_cast<uint32_t>(arena.size());
+        key.length = static_cast<uint32_t>(text.size());
+        key.index = i;
+        for(size_t c = 0; c < text.size(); c++)
+        {
+            const auto folded = static_cast<unsigned char>(
+                tolower(static_cast<unsigned char>(text[c])));
+            arena += static_cast<char>(folded);
+            if(c < keyBytes)
+                key.prefix |= static_cast<uint64_t>(folded) << (8 * (keyBytes - 1 - c));
+        }
+    }
+    const string_view folded(arena);
+    sort(keys.begin(), keys.end(), [&](const SortKey& k1, const SortKey& k2) {
+        if(k1.prefix != k2.prefix)
+            return k1.prefix < k2.prefix;
+        return folded.substr(k1.offset, k1.length) < 
+            folded.substr(k2.offset, k2.length);
+    });
+    vector<uint32_t> order(count);
+    for(size_t i = 0; i < count; i++)
+        order[i] = keys[i].index;
+    return order;
+}
+
+template<typename T>
+void applyOrder(vector<T>& items, const vector<uint32_t>& order)
+{
+    vector<T> sorted;
+    sorted.reserve(items.size());
+    for(const uint32_t index : order)
+        sorted.push_back(move(items[index]));
+    items.swap(sorted);
+}
+
+// case insensitive by name
+void sortAlphabetic(vector<Entry>& entries)
 {
-    // case insensitive alphabetic sort
-    string name1 = e1.path.filename().string();
-    string name2 = e2.path.filename().string();
-    transform(name1.begin(), name1.end(), name1.begin(), ::tolower);
-    transform(name2.begin(), name2.end(), name2.begin(), ::tolower);
-    return (name1.compare(name2) < 0);
+    applyOrder(entries, sortOrder(entries.size(), 
+        [&](size_t i) { return entries[i].path.filename().string(); }, 
+        [](size_t) { return false; }));
 }
 
 bool sizeSort(const Entry& e1, const Entry& e2)
 {
+    if(tackU)
+        return (e1.diskSize > e2.diskSize);
     return (e1.size > e2.size);
 }
 
-void printEntry(const Entry& entry)
+void printSize(uint64_t size)
 {
-    double roundedFileSize = static_cast<double>(entry.size);
+    double roundedFileSize = static_cast<double>(size);
     unsigned long unitIndex = 0;
     for(unsigned long i = 0; i < sizeUnits.size(); i++)
     {
@@ -142,24 +1200,734 @@ void printEntry(const Entry& entry)
     }
     cout << setw(6) << fixed << setprecision(1) << roundedFileSize;
     cout << sizeUnits[unitIndex] << " ";
+}
+
+void printEntry(const Entry& entry)
+{
+    if(tackB)
+    {
+        printSize(entry.size);
+        printSize(entry.diskSize);
+    }
+    else
+        printSize(tackU ? entry.diskSize : entry.size);
     cout << entry.path.string() << "\n";
 }
 
+void sumTree()
+{
+    // children follow their parents, so one backwards pass adds every
+    // subtree into its parent before the parent itself is read
+    for(size_t index = tree.nodes.size() - 1; index > 0; index--)
+        tree.nodes[tree.nodes[index].parent].total += tree.nodes[index].total;
+}
+
+string joinPath(const string& base, const string& name)
+{
+    // a root of "/" already ends in the separator
+    return (!base.empty() && base.back() == '/') ? base + name : base + "/" + name;
+}
+
+string treePath(size_t index)
+{
+    const TreeNode& node = tree.nodes[index];
+    const string name = tree.names.substr(node.nameOffset, node.nameLength);
+    if(index == 0)
+        return name;
+    return joinPath(treePath(node.parent), name);
+}
+
+Entry treeEntry(size_t index)
+{
+    return Entry{ treePath(index), tree.nodes[index].total.apparent, 
+        tree.nodes[index].total.disk };
+}
+
+string_view treeName(size_t index)
+{
+    return string_view(tree.names).substr(tree.nodes[index].nameOffset, 
+        tree.nodes[index].nameLength);
+}
+
+// case insensitive, with ties broken by the exact bytes
+bool nameBefore(string_view n1, string_view n2)
+{
+    const size_t length = min(n1.size(), n2.size());
+    for(size_t i = 0; i < length; i++)
+    {
+        const int c1 = tolower(static_cast<unsigned char>(n1[i]));
+        const int c2 = tolower(static_cast<unsigned char>(n2[i]));
+        if(c1 != c2)
+            return c1 < c2;
+    }
+    return (n1.size() != n2.size()) ? (n1.size() < n2.size()) : (n1 < n2);
+}
+
+// visits the tree depth first, each directory just before its subtree and
+// siblings in the order of before. visit gets the node, its depth and its
+// path below the root, and returns whether to go into its children
+template<typename Before, typename Visit>
+void walkTree(Before before, Visit visit)
+{
+    const size_t count = tree.nodes.size();
+    if(count == 0)
+        return;
+    // children of node i are children[firstChild[i]] up to firstChild[i + 1]
+    vector<uint32_t> firstChild(count + 1, 0);
+    for(size_t index = 1; index < count; index++)
+        firstChild[tree.nodes[index].parent + 1]++;
+    for(size_t index = 1; index <= count; index++)
+        firstChild[index] += firstChild[index - 1];
+    vector<uint32_t> children(count);
+    vector<uint32_t> filled(firstChild.begin(), firstChild.end() - 1);
+    for(size_t index = 1; index < count; index++)
+        children[filled[tree.nodes[index].parent]++] = static_cast<uint32_t>(index);
+    for(size_t index = 0; index < count; index++)
+        sort(children.begin() + firstChild[index], 
+            children.begin() + firstChild[index + 1], 
+            [&](uint32_t n1, uint32_t n2) { return before(treeName(n1), treeName(n2)); });
+    string path;
+    // node, next child to visit and the length of its path
+    vector<array<size_t, 3>> stack;
+    if(visit(0, 0, path))
+        stack.push_back({ 0, firstChild[0], 0 });
+    while(!stack.empty())
+    {
+        const auto [node, next, pathLength] = stack.back();
+        if(next == firstChild[node + 1])
+        {
+            stack.pop_back();
+            continue;
+        }
+        stack.back()[1]++;
+        const size_t child = children[next];
+        path.resize(pathLength);
+        if(!path.empty())
+            path += '/';
+        path += treeName(child);
+        if(visit(child, stack.size(), path))
+            stack.push_back({ child, firstChild[child], path.size() });
+    }
+}
+
+void printTreeReport()
+{
+    vector<uint32_t> depths(tree.nodes.size(), 0);
+    for(size_t index = 1; index < tree.nodes.size(); index++)
+        depths[index] = depths[tree.nodes[index].parent] + 1;
+    const auto withinDepth = [&depths](size_t index) {
+        return tackD < 0 || depths[index] <= static_cast<uint32_t>(tackD);
+    };
+    vector<Entry> entries;
+    if(tackT > 0)
+    {
+        // a min heap holding the largest directories seen so far
+        using Candidate = pair<uint64_t, size_t>;
+        priority_queue<Candidate, vector<Candidate>, greater<Candidate>> largest;
+        for(size_t index = 1; index < tree.nodes.size(); index++)
+        {
+            if(!withinDepth(index))
+                continue;
+            const Sizes& total = tree.nodes[index].total;
+            const Candidate candidate{ tackU ? total.disk : total.apparent, index };
+            if(largest.size() < tackT)
+                largest.push(candidate);
+            else if(candidate > largest.top())
+            {
+                largest.pop();
+                largest.push(candidate);
+            }
+        }
+        for(; !largest.empty(); largest.pop())
+            entries.push_back(treeEntry(largest.top().second));
+        reverse(entries.begin(), entries.end());
+    }
+    else if(tackS)
+    {
+        for(size_t index = 1; index < tree.nodes.size(); index++)
+        {
+            if(withinDepth(index))
+                entries.push_back(treeEntry(index));
+        }
+        sort(entries.begin(), entries.end(), sizeSort);
+    }
+    else
+    {
+        // walked in order, so subtrees stay together without sorting paths
+        const string root(treeName(0));
+        walkTree(nameBefore, [&](size_t index, size_t depth, const string& path) {
+            if(index != 0)
+                entries.push_back(Entry{ joinPath(root, path), 
+                    tree.nodes[index].total.apparent, tree.nodes[index].total.disk });
+            return tackD < 0 || depth < static_cast<size_t>(tackD);
+        });
+    }
+    for(const auto& entry : entries)
+        printEntry(entry);
+    printEntry(treeEntry(0));
+}
+
+// writes every node of the tree in path order, each directory followed by
+// its subtree with siblings sorted by name
+void writeSnapshot(const string& root)
+{
+    vector<SnapshotRecord> records;
+    records.reserve(tree.nodes.size());
+    string names = root;
+    string previous;
+    // byte order, the order --diff merges in
+    walkTree([](string_view n1, string_view n2) { return n1 < n2; }, 
+        [&](size_t index, size_t, const string& path) {
+        const size_t shared = static_cast<size_t>(mismatch(path.begin(), 
+            path.begin() + static_cast<long>(min(path.size(), previous.size())), 
+            previous.begin()).first - path.begin());
+        const Sizes& total = tree.nodes[index].total;
+        records.push_back(SnapshotRecord{ static_cast<uint32_t>(shared), 
+            static_cast<uint32_t>(path.size() - shared), 
+            total.apparent, total.disk });
+        names.append(path, shared, string::npos);
+        previous = path;
+        return true;
+    });
+    SnapshotHeader header{};
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = snapshotVersion;
+    header.count = records.size();
+    header.namesSize = names.size();
+    header.rootLength = root.size();
+    const string temporary = tackSnapshot + ".tmp";
+    ofstream file(temporary, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), 
+        static_cast<streamsize>(records.size() * sizeof(SnapshotRecord)));
+    file.write(names.data(), static_cast<streamsize>(names.size()));
+    file.close();
+    if(!file || rename(temporary.c_str(), tackSnapshot.c_str()) != 0)
+        cerr << "ERROR: Could not write snapshot \"" << tackSnapshot << "\"\n";
+}
+
+Snapshot loadSnapshot(const string& path)
+{
+    const int snapshotFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if(snapshotFd < 0 || fstat(snapshotFd, &info) != 0 || 
+        static_cast<size_t>(info.st_size) < sizeof(SnapshotHeader))
+        printUsage("badPath", path);
+    const auto fileSize = static_cast<size_t>(info.st_size);
+    void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, snapshotFd, 0);
+    close(snapshotFd);
+    if(mapped == MAP_FAILED)
+        printUsage("badPath", path);
+    // records are read once, front to back
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+    const auto* header = static_cast<const SnapshotHeader*>(mapped);
+    if(memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) != 0 || 
+        header->version != snapshotVersion || header->rootLength > header->namesSize || 
+        fileSize != sizeof(SnapshotHeader) + 
+        header->count * sizeof(SnapshotRecord) + header->namesSize)
+    {
+        cerr << "ERROR: Not a snapshot \"" << path << "\"\n";
+        exit(1);
+    }
+    const auto* records = reinterpret_cast<const SnapshotRecord*>(header + 1);
+    return Snapshot{ header, records, 
+        reinterpret_cast<const char*>(records + header->count) };
+}
+
+// moves to the next record, false once there are none
+bool advanceSnapshot(SnapshotCursor& cursor)
+{
+    const SnapshotHeader& header = *cursor.snapshot->header;
+    if(cursor.index == header.count)
+        return false;
+    cursor.record = &cursor.snapshot->records[cursor.index++];
+    const size_t length = cursor.record->suffixLength;
+    if(cursor.record->shared > cursor.path.size() || 
+        cursor.nameOffset + length > header.namesSize)
+    {
+        cerr << "ERROR: Corrupt snapshot\n";
+        exit(1);
+    }
+    cursor.path.resize(cursor.record->shared);
+    cursor.path.append(cursor.snapshot->names + cursor.nameOffset, length);
+    cursor.nameOffset += length;
+    return true;
+}
+
+// the order snapshots are written in, where '/' sorts before every other
+// byte so a directory's subtree comes right after it
+int comparePaths(const string& p1, const string& p2)
+{
+    const size_t length = min(p1.size(), p2.size());
+    const auto differ = mismatch(p1.begin(), p1.begin() + static_cast<long>(length), 
+        p2.begin());
+    if(differ.first == p1.begin() + static_cast<long>(length))
+        return (p1.size() < p2.size()) ? -1 : (p1.size() > p2.size()) ? 1 : 0;
+    const auto rank = [](char c) { 
+        return (c == '/') ? 0 : static_cast<int>(static_cast<unsigned char>(c)); };
+    return (rank(*differ.first) < rank(*differ.second)) ? -1 : 1;
+}
+
+// merge joins the two snapshots, a directory missing from the old one
+// grew by its whole size
+void diffSnapshots()
+{
+    const Snapshot older = loadSnapshot(tackDiffOld);
+    const Snapshot newer = loadSnapshot(tackDiffNew);
+    const size_t limit = (tackT > 0) ? tackT : diffDefault;
+    const auto measure = [](const SnapshotRecord& record) {
+        return tackU ? record.disk : record.apparent;
+    };
+    struct Growth {
+        uint64_t delta;
+        uint64_t size;
+        string path;
+    };
+    // a min heap holding the largest growths seen so far
+    const auto larger = [](const Growth& g1, const Growth& g2) { 
+        return g1.delta > g2.delta; };
+    priority_queue<Growth, vector<Growth>, decltype(larger)> largest(larger);
+    SnapshotCursor oldCursor{ &older, 0, older.header->rootLength, nullptr, "" };
+    SnapshotCursor newCursor{ &newer, 0, newer.header->rootLength, nullptr, "" };
+    bool haveOld = advanceSnapshot(oldCursor);
+    bool haveNew = advanceSnapshot(newCursor);
+    while(haveNew)
+    {
+        const int order = haveOld ? comparePaths(oldCursor.path, newCursor.path) : 1;
+        // removed since the old snapshot
+        if(order < 0)
+        {
+            haveOld = advanceSnapshot(oldCursor);
+            continue;
+        }
+        const uint64_t before = (order == 0) ? measure(*oldCursor.record) : 0;
+        const uint64_t after = measure(*newCursor.record);
+        if(after > before && (largest.size() < limit || 
+            after - before > largest.top().delta))
+        {
+            largest.push(Growth{ after - before, after, newCursor.path });
+            if(largest.size() > limit)
+                largest.pop();
+        }
+        if(order == 0)
+            haveOld = advanceSnapshot(oldCursor);
+        haveNew = advanceSnapshot(newCursor);
+    }
+    vector<Growth> growths;
+    for(; !largest.empty(); largest.pop())
+        growths.push_back(largest.top());
+    const string root(newer.names, newer.header->rootLength);
+    for(auto growth = growths.rbegin(); growth != growths.rend(); growth++)
+    {
+        printSize(growth->delta);
+        printSize(growth->size);
+        cout << (growth->path.empty() ? root : joinPath(root, growth->path)) << "\n";
+    }
+}
+
+string handleKey(const void* fsid, const file_handle* handle)
+{
+    string key(static_cast<const char*>(fsid), sizeof(__kernel_fsid_t));
+    key.append(reinterpret_cast<const char*>(handle), 
+        sizeof(file_handle) + handle->handle_bytes);
+    return key;
+}
+
+// a filesystem wide mark only covers one filesystem, so each new device
+// met in the walk, such as a nested mount, is marked as it is reached
+bool fanotifyCovers(Watch& watch, int dirFd)
+{
+    struct stat info;
+    if(watch.fanotifyFd < 0 || fstat(dirFd, &info) != 0)
+        return false;
+    for(const auto& device : watch.devices)
+    {
+        if(device.first == info.st_dev)
+            return device.second;
+    }
+    const bool marked = fanotify_mark(watch.fanotifyFd, 
+        FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fanotifyEvents, dirFd, nullptr) == 0;
+    watch.devices.emplace_back(info.st_dev, marked);
+    return marked;
+}
+
+void watchDirectory(Watch& watch, size_t index, int dirFd)
+{
+    if(fanotifyCovers(watch, dirFd))
+    {
+        // fanotify reports the parent directory as a file handle
+        alignas(file_handle) char storage[sizeof(file_handle) + MAX_HANDLE_SZ];
+        auto* handle = reinterpret_cast<file_handle*>(storage);
+        handle->handle_bytes = MAX_HANDLE_SZ;
+        int mountId;
+        struct statfs filesystem;
+        if(fstatfs(dirFd, &filesystem) == 0 && 
+            name_to_handle_at(dirFd, "", handle, &mountId, AT_EMPTY_PATH) == 0)
+        {
+            watch.nodes[index].handle = handleKey(&filesystem.f_fsid, handle);
+            watch.byHandle[watch.nodes[index].handle] = index;
+        }
+        return;
+    }
+    if(watch.inotifyFd < 0)
+        watch.inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    // inotify needs a path, the fd's proc link avoids rebuilding one
+    const string fdPath = "/proc/self/fd/" + to_string(dirFd);
+    const int wd = inotify_add_watch(watch.inotifyFd, fdPath.c_str(), 
+        IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | 
+        IN_ATTRIB | IN_ONLYDIR);
+    if(wd < 0)
+    {
+        if(!watch.warned)
+            cerr << "ERROR: Could not add inotify watch: " << strerror(errno) << "\n";
+        watch.warned = true;
+        return;
+    }
+    watch.nodes[index].wd = wd;
+    watch.byWatch[wd] = index;
+}
+
+void forgetDirectory(Watch& watch, size_t index)
+{
+    WatchNode& node = watch.nodes[index];
+    if(node.wd >= 0)
+    {
+        inotify_rm_watch(watch.inotifyFd, node.wd);
+        watch.byWatch.erase(node.wd);
+    }
+    if(!node.handle.empty())
+        watch.byHandle.erase(node.handle);
+    node = WatchNode();
+    watch.freeNodes.push_back(index);
+}
+
+// adds total to every directory from index up to the root, sizes are
+// unsigned so removals are passed as the subtrahend
+void adjustTotals(Watch& watch, size_t index, const Sizes& add, 
+    const Sizes& remove)
+{
+    while(true)
+    {
+        Sizes& total = watch.nodes[index].total;
+        total += add;
+        total.apparent -= remove.apparent;
+        total.disk -= remove.disk;
+        if(index == 0)
+            return;
+        index = watch.nodes[index].parent;
+    }
+}
+
+// scans dirFd and everything below it into the tree, returning the new node
+size_t buildNode(Watch& watch, size_t parent, const string& name, int dirFd)
+{
+    size_t index = watch.nodes.size();
+    if(!watch.freeNodes.empty())
+    {
+        index = watch.freeNodes.back();
+        watch.freeNodes.pop_back();
+    }
+    else
+        watch.nodes.emplace_back();
+    watch.nodes[index].parent = parent;
+    watch.nodes[index].name = name;
+    watch.nodes[index].alive = true;
+    // subscribe before scanning so changes made during the scan are seen
+    watchDirectory(watch, index, dirFd);
+    vector<string> subdirectories;
+    const Sizes direct = scanDirectory(dirFd, subdirectories);
+    watch.nodes[index].direct = direct;
+    watch.nodes[index].total = direct;
+    for(const auto& subdirectory : subdirectories)
+    {
+        const int childFd = openDirectory(dirFd, subdirectory.c_str());
+        if(childFd < 0)
+            continue;
+        const size_t child = buildNode(watch, index, subdirectory, childFd);
+        close(childFd);
+        watch.nodes[index].children.push_back(child);
+        watch.nodes[index].total += watch.nodes[child].total;
+    }
+    return index;
+}
+
+void removeSubtree(Watch& watch, size_t index)
+{
+    for(const size_t child : watch.nodes[index].children)
+        removeSubtree(watch, child);
+    forgetDirectory(watch, index);
+}
+
+string nodePath(const Watch& watch, size_t index)
+{
+    if(index == 0)
+        return watch.nodes[0].name;
+    return joinPath(nodePath(watch, watch.nodes[index].parent), 
+        watch.nodes[index].name);
+}
+
+void rescanNode(Watch& watch, size_t index)
+{
+    watch.nodes[index].dirty = false;
+    const int dirFd = openDirectory(AT_FDCWD, nodePath(watch, index).c_str(), 
+        index == 0);
+    // a directory that vanished is removed when its parent is rescanned
+    if(dirFd < 0)
+        return;
+    vector<string> subdirectories;
+    const Sizes direct = scanDirectory(dirFd, subdirectories);
+    adjustTotals(watch, index, direct, watch.nodes[index].direct);
+    watch.nodes[index].direct = direct;
+    // drop subdirectories that are gone, then add the new ones
+    sort(subdirectories.begin(), subdirectories.end());
+    vector<size_t> kept;
+    for(const size_t child : watch.nodes[index].children)
+    {
+        if(binary_search(subdirectories.begin(), subdirectories.end(), 
+            watch.nodes[child].name))
+            kept.push_back(child);
+        else
+        {
+            adjustTotals(watch, index, Sizes(), watch.nodes[child].total);
+            removeSubtree(watch, child);
+        }
+    }
+    for(const auto& subdirectory : subdirectories)
+    {
+        const bool known = any_of(kept.begin(), kept.end(), 
+            [&](size_t child) { return watch.nodes[child].name == subdirectory; });
+        if(known)
+            continue;
+        const int childFd = openDirectory(dirFd, subdirectory.c_str());
+        if(childFd < 0)
+            continue;
+        const size_t child = buildNode(watch, index, subdirectory, childFd);
+        close(childFd);
+        kept.push_back(child);
+        adjustTotals(watch, index, watch.nodes[child].total, Sizes());
+    }
+    watch.nodes[index].children = kept;
+    close(dirFd);
+}
+
+void markDirty(Watch& watch, size_t index)
+{
+    if(!watch.nodes[index].alive || watch.nodes[index].dirty)
+        return;
+    watch.nodes[index].dirty = true;
+    watch.dirty.push_back(index);
+}
+
+void markAllDirty(Watch& watch)
+{
+    for(size_t index = 0; index < watch.nodes.size(); index++)
+        markDirty(watch, index);
+}
+
+void readFanotifyEvents(Watch& watch)
+{
+    alignas(fanotify_event_metadata) char events[64 * 1024];
+    const ssize_t length = read(watch.fanotifyFd, events, sizeof(events));
+    if(length <= 0)
+        return;
+    auto remaining = length;
+    const auto* event = reinterpret_cast<const fanotify_event_metadata*>(events);
+    for(; FAN_EVENT_OK(event, remaining); event = FAN_EVENT_NEXT(event, remaining))
+    {
+        if(event->vers != FANOTIFY_METADATA_VERSION)
+            break;
+        if(event->mask & FAN_Q_OVERFLOW)
+        {
+            markAllDirty(watch);
+            continue;
+        }
+        const auto* info = reinterpret_cast<const fanotify_event_info_fid*>(event + 1);
+        if(event->event_len <= sizeof(*event) || 
+            (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && 
+            info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID))
+            continue;
+        const auto* handle = reinterpret_cast<const file_handle*>(info->handle);
+        const string key = handleKey(&info->fsid, handle);
+        // events from the rest of the filesystem are not in the map
+        const auto found = watch.byHandle.find(key);
+        if(found != watch.byHandle.end())
+            markDirty(watch, found->second);
+    }
+}
+
+void readInotifyEvents(Watch& watch)
+{
+    alignas(inotify_event) char events[64 * 1024];
+    const ssize_t length = read(watch.inotifyFd, events, sizeof(events));
+    for(ssize_t offset = 0; offset < length;)
+    {
+        const auto* event = reinterpret_cast<const inotify_event*>(events + offset);
+        offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        if(event->mask & IN_Q_OVERFLOW)
+        {
+            markAllDirty(watch);
+            continue;
+        }
+        const auto found = watch.byWatch.find(event->wd);
+        if(found != watch.byWatch.end())
+            markDirty(watch, found->second);
+    }
+}
+
+void openEvents(Watch& watch, const string& path)
+{
+    // a filesystem wide fanotify mark needs no per directory setup, but
+    // needs CAP_SYS_ADMIN and a kernel that reports directory handles
+    watch.fanotifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | 
+        FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+    if(watch.fanotifyFd >= 0)
+    {
+        struct stat info;
+        if(stat(path.c_str(), &info) == 0 && 
+            fanotify_mark(watch.fanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, 
+            fanotifyEvents, AT_FDCWD, path.c_str()) == 0)
+        {
+            watch.devices.emplace_back(info.st_dev, true);
+            return;
+        }
+        close(watch.fanotifyFd);
+        watch.fanotifyFd = -1;
+    }
+    watch.inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(watch.inotifyFd < 0)
+    {
+        cerr << "ERROR: Could not watch \"" << path << "\": " 
+            << strerror(errno) << "\n";
+        exit(1);
+    }
+}
+
+void printWatch(const Watch& watch)
+{
+    // redraw in place on a terminal, otherwise separate tables by a line
+    if(isatty(STDOUT_FILENO))
+        cout << "\033[2J\033[H";
+    else
+        cout << "\n";
+    vector<Entry> entries;
+    for(const size_t child : watch.nodes[0].children)
+    {
+        entries.push_back(Entry{ filesystem::path(watch.nodes[0].name) / 
+            watch.nodes[child].name, watch.nodes[child].total.apparent, 
+            watch.nodes[child].total.disk });
+    }
+    if(tackS)
+        sort(entries.begin(), entries.end(), sizeSort);
+    else
+        sortAlphabetic(entries);
+    for(const auto& entry : entries)
+        printEntry(entry);
+    printEntry(Entry{ watch.nodes[0].name, watch.nodes[0].total.apparent, 
+        watch.nodes[0].total.disk });
+    cout << flush;
+}
+
+void watchSizes(const string& path)
+{
+    Watch watch;
+    openEvents(watch, path);
+    const int rootFd = openDirectory(AT_FDCWD, path.c_str(), true);
+    if(rootFd < 0)
+        exit(1);
+    buildNode(watch, 0, path, rootFd);
+    close(rootFd);
+    while(true)
+    {
+        // inotify may have been opened since for a filesystem fanotify
+        // could not mark, in which case both are read
+        pollfd events[2] = { { watch.fanotifyFd, POLLIN, 0 }, 
+            { watch.inotifyFd, POLLIN, 0 } };
+        printWatch(watch);
+        // collect events for one interval, then rescan what they touched
+        const auto deadline = chrono::steady_clock::now() + watchInterval;
+        bool changed = false;
+        while(!changed || chrono::steady_clock::now() < deadline)
+        {
+            const auto left = chrono::duration_cast<chrono::milliseconds>(
+                deadline - chrono::steady_clock::now()).count();
+            if(poll(events, 2, changed ? static_cast<int>(max(left, 0L)) : -1) <= 0)
+                continue;
+            if(events[0].revents != 0)
+                readFanotifyEvents(watch);
+            if(events[1].revents != 0)
+                readInotifyEvents(watch);
+            changed = !watch.dirty.empty();
+        }
+        vector<size_t> dirty;
+        dirty.swap(watch.dirty);
+        for(const size_t index : dirty)
+        {
+            if(watch.nodes[index].alive && watch.nodes[index].dirty)
+                rescanNode(watch, index);
+        }
+    }
+}
+
 int main(int argc, char** argv)
 {
     const int pathIndex = getFlags(argc, argv);
+    if(tackDiffOld != "")
+    {
+        diffSnapshots();
+        return 0;
+    }
     const string path = (pathIndex == -1) ? 
         filesystem::current_path().string() : 
         static_cast<string>(argv[pathIndex]);
-    if (!filesystem::exists(path))
+    struct stat pathInfo;
+    if (!filesystem::exists(path) || stat(path.c_str(), &pathInfo) != 0)
         printUsage("badPath", path);
+    startDevice = pathInfo.st_dev;
+    if(tackW)
+    {
+        // rescans would only grow the cache, so it is not used here
+        tackC = "";
+        watchSizes(path);
+    }
+    if(tackC != "")
+        loadCache();
+    const bool treeReport = tackD >= 0 || tackT > 0;
+    // a snapshot holds every directory's total, so it needs the tree too
+    const bool buildTree = treeReport || tackSnapshot != "";
+    if(buildTree)
+        tree.nodes.push_back(TreeNode{ 0, static_cast<uint32_t>(path.size()), 0, 
+            Sizes() });
+    tree.names = buildTree ? path : "";
     vector<Entry> entries;
-    fillEntryVector(entries, path);
-    uint64_t pathSize = getFileSizes(path);
-    pathSize += sumSubdirectorySizes(entries);
-    sort(entries.begin(), entries.end(), (tackS) ? sizeSort : alphabeticSort);
-    for(const auto& entry : entries)
-        printEntry(entry);
-    printEntry(Entry{ path, pathSize });
+    timePhase("fillEntryVector", [&] { fillEntryVector(entries, path); });
+    Sizes pathSize;
+    timePhase("getFileSizes", [&] { pathSize = getFileSizes(path); });
+    if(buildTree)
+        tree.nodes[0].total = pathSize;
+    timePhase("getDirectorySize", [&] { 
+        pathSize += sumSubdirectorySizes(entries); });
+    if(buildTree)
+        timePhase("sumTree", [] { sumTree(); });
+    if(treeReport)
+        timePhase("print", [] { printTreeReport(); });
+    else
+    {
+        timePhase("sort", [&] { 
+            if(tackS)
+                sort(entries.begin(), entries.end(), sizeSort);
+            else
+                sortAlphabetic(entries); });
+        timePhase("print", [&] {
+            for(const auto& entry : entries)
+                printEntry(entry);
+            printEntry(Entry{ path, pathSize.apparent, pathSize.disk });
+        });
+    }
+    if(tackSnapshot != "")
+        timePhase("writeSnapshot", [&] { writeSnapshot(path); });
+    if(tackC != "")
+        timePhase("saveCache", [] { saveCache(); });
+    if(tackStats || tackStatsJson != "")
+        printStats();
     return 0;
 }
\ No newline at end of file
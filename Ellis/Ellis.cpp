@@ -2,199 +2,717 @@
 * Ellis - a take on 'ls'
 *
 * Compilation:
-* clang++ -std=c++17 -O2 Ellis.cpp -o ellis (with added warnings)
+* clang++ -std=c++17 -O2 -pthread Ellis.cpp -o ellis (with added warnings)
 */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <fstream>
 #include <grp.h>
 #include <iostream>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
 #include <pwd.h>
-#include <sstream>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
 
-#define BOLD string("\033[1;")
-#define NORMAL string("\033[0;")
-#define BLUE string("34m")
-#define MAGENTA string("35m")
-#define CYAN string("36m")
-#define WHITE string("37m")
+const string_view boldBlue = "\033[1;34m";
+const string_view boldCyan = "\033[1;36m";
+const string_view boldWhite = "\033[1;37m";
+const string_view normalCyan = "\033[0;36m";
+const string_view normalMagenta = "\033[0;35m";
+const string_view normalWhite = "\033[0;37m";
 
 struct Entry {
-    filesystem::path path;
+    string fileName;
+    // d_type from the directory listing
+    unsigned char type;
     bool isDirectory;
     bool isSymlink;
-    string perms;
-    string owner;
-    string size;
-    string name;
+    // raw fields of the entry's one statx, of the link itself for symlinks
+    bool hasInfo;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t bytes;
+    int64_t modified;
+    uint32_t modifiedNsec;
+    string linkTarget;
 };
 
 bool tackS = false;
 bool tackA = false;
+bool tackP = false;
+bool tackU = false;
+// -S and -t sort by size or modification time, -r reverses the order
+bool tackSize = false;
+bool tackTime = false;
+bool tackR = false;
+// entries printed, from --head
+size_t tackHead = SIZE_MAX;
+bool tackRecursive = false;
+// listings -R may hold ahead of the output, from --window
+size_t tackWindow = 64;
+// metadata requests kept in flight, in the ring or as threads
+unsigned long tackJ = 32;
 const array<string, 5> sizeUnits { "B ", "KB", "MB", "GB", "TB" };
 
-void getPermissions(Entry& entry)
+// user or group names by id, each looked up once. a listing rarely has
+// more than a few owners, so this is a small sorted array
+struct NameCache {
+    // id and its index in names, sorted by id
+    vector<pair<uint32_t, uint32_t>> index;
+    // each distinct name is stored once, unknown ids map to ""
+    vector<string> names;
+};
+
+NameCache userNames;
+NameCache groupNames;
+
+// entries per claim by a metadata thread, smaller directories are
+// done on the main thread
+const size_t metadataBatch = 64;
+const unsigned statxMask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | 
+    STATX_SIZE | STATX_MTIME;
+
+struct Uring {
+    int fd = -1;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    unsigned pending = 0;
+};
+
+Uring uring;
+
+// a statx in flight, entry is its index in the vector being filled
+struct StatxSlot {
+    struct statx info;
+    size_t entry;
+    // the second request for a symlink, which follows it
+    bool follow;
+};
+
+// layout of the records returned by getdents64
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+
+const size_t direntBufferSize = 64 * 1024;
+alignas(8) thread_local char direntBuffer[direntBufferSize];
+
+// position in the records of the last getdents64 call
+struct DirectoryStream {
+    int fd;
+    long bytes = 0;
+    long offset = 0;
+};
+
+// entries read, stat'ed and printed at a time by -U
+const size_t streamBatch = 1024;
+
+// everything printed goes through this buffer, one write() per flush
+const size_t outputSize = 256 * 1024;
+char outputBuffer[outputSize];
+size_t outputLength = 0;
+
+// rwx text for each octal digit of the mode
+const array<array<char, 3>, 8> permissionBits {{
+    {{ '-', '-', '-' }}, {{ '-', '-', 'x' }}, {{ '-', 'w', '-' }}, 
+    {{ '-', 'w', 'x' }}, {{ 'r', '-', '-' }}, {{ 'r', '-', 'x' }}, 
+    {{ 'r', 'w', '-' }}, {{ 'r', 'w', 'x' }} }};
+
+// longest formatted size, "16777216.00TB" for 2^64 bytes
+const size_t sizeTextMax = 16;
+
+// the long format's fields that need widths, one element per entry,
+// kept between listings so their storage is reused
+struct Columns {
+    // "user group" for each pair of ids seen, by uid << 32 | gid.
+    // entries without metadata use the first one
+    vector<string> owners { "NULL" };
+    vector<pair<uint64_t, uint32_t>> ownerIndex;
+    // per entry, an index into owners and the formatted size
+    vector<uint32_t> owner;
+    vector<array<char, sizeTextMax>> size;
+    vector<uint8_t> sizeLength;
+    // only ever widened, so -U batches stay aligned with the ones before
+    size_t ownerWidth = 0;
+    size_t sizeWidth = 0;
+};
+
+Columns columns;
+
+// one directory of a -R listing, read, stat'ed and sorted by the
+// prefetch workers before the printing thread gets to it
+struct Listing {
+    // subdirectories are opened relative to the parent's fd, which stays
+    // open until the printer has reached all of them
+    Listing* parent = nullptr;
+    string name;
+    // printed above the entries, the root's is the path given
+    string path;
+    int fd = -1;
+    int error = 0;
+    vector<Entry> entries;
+    // a listing for each subdirectory, in output order
+    vector<shared_ptr<Listing>> children;
+    enum { waiting, listing, listed } state = waiting;
+};
+
+// the printer's position in one listing's subdirectories
+struct Frame {
+    shared_ptr<Listing> listing;
+    size_t cursor;
+};
+
+// directories waiting to be listed, next in output order at the front
+struct Prefetch {
+    mutex lock;
+    // workers wait for work one at a time, the printer for its listing
+    condition_variable work;
+    condition_variable listed;
+    deque<weak_ptr<Listing>> waiting;
+    // listings filled but not yet reached by the printing thread
+    size_t ahead = 0;
+    bool workers = false;
+    bool finished = false;
+};
+
+Prefetch prefetch;
+
+const string& addName(NameCache& cache, uint32_t id, const string& name)
 {
-    stringstream output;
-    if(entry.isSymlink)
-        output << "l";
-    else if(entry.isDirectory)
-        output << "d";
+    auto found = lower_bound(cache.index.begin(), cache.index.end(), 
+        make_pair(id, 0U));
+    // the first entry for an id wins, as it does for getpwuid
+    if(found != cache.index.end() && found->first == id)
+        return cache.names[found->second];
+    auto interned = find(cache.names.begin(), cache.names.end(), name);
+    if(interned == cache.names.end())
+        interned = cache.names.insert(cache.names.end(), name);
+    const auto nameIndex = static_cast<uint32_t>(interned - cache.names.begin());
+    cache.index.insert(found, make_pair(id, nameIndex));
+    return cache.names[nameIndex];
+}
+
+// resolve is only called for ids not seen before, and never with -P
+template<typename Resolve>
+const string& lookupName(NameCache& cache, uint32_t id, Resolve resolve)
+{
+    const auto found = lower_bound(cache.index.begin(), cache.index.end(), 
+        make_pair(id, 0U));
+    if(found != cache.index.end() && found->first == id)
+        return cache.names[found->second];
+    return addName(cache, id, tackP ? string() : resolve(id));
+}
+
+// reads name:password:id: lines from /etc/passwd or /etc/group. every
+// line brings a new name, so they are appended without interning and
+// the index is sorted once at the end
+void preloadNames(NameCache& cache, const string& path)
+{
+    ifstream file(path);
+    string line;
+    while(getline(file, line))
+    {
+        const size_t nameEnd = line.find(':');
+        const size_t idStart = line.find(':', nameEnd + 1);
+        if(nameEnd == string::npos || idStart == string::npos)
+            continue;
+        const string id = line.substr(idStart + 1, 
+            line.find(':', idStart + 1) - idStart - 1);
+        if(id.empty() || id.find_first_not_of("0123456789") != string::npos)
+            continue;
+        cache.index.emplace_back(static_cast<uint32_t>(stoul(id)), 
+            static_cast<uint32_t>(cache.names.size()));
+        cache.names.push_back(line.substr(0, nameEnd));
+    }
+    // the first entry for an id wins, as it does for getpwuid
+    stable_sort(cache.index.begin(), cache.index.end(), 
+        [](const pair<uint32_t, uint32_t>& p1, const pair<uint32_t, uint32_t>& p2) { 
+            return p1.first < p2.first; });
+    cache.index.erase(unique(cache.index.begin(), cache.index.end(), 
+        [](const pair<uint32_t, uint32_t>& p1, const pair<uint32_t, uint32_t>& p2) { 
+            return p1.first == p2.first; }), cache.index.end());
+}
+
+void storeStatx(Entry& entry, const struct statx& info)
+{
+    entry.hasInfo = true;
+    entry.mode = info.stx_mode;
+    entry.uid = info.stx_uid;
+    entry.gid = info.stx_gid;
+    entry.bytes = info.stx_size;
+    entry.modified = info.stx_mtime.tv_sec;
+    entry.modifiedNsec = info.stx_mtime.tv_nsec;
+    entry.isDirectory = S_ISDIR(info.stx_mode);
+    entry.isSymlink = S_ISLNK(info.stx_mode);
+}
+
+void readLinkTarget(int dirFd, Entry& entry)
+{
+    char link[PATH_MAX];
+    const ssize_t length = readlinkat(dirFd, entry.fileName.c_str(), link, 
+        sizeof(link));
+    if(length > 0)
+        entry.linkTarget.assign(link, static_cast<size_t>(length));
+}
+
+// -s prints no attributes, but -S and -t still sort by them
+bool needsStatx()
+{
+    return !tackS || tackSize || tackTime;
+}
+
+void getMetadata(int dirFd, Entry& entry)
+{
+    const char* name = entry.fileName.c_str();
+    struct statx info;
+    if(needsStatx() && statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, 
+        statxMask, &info) == 0)
+        storeStatx(entry, info);
     else
-        output << "-";
-    const auto perms = filesystem::status(entry.path).permissions();
-    const auto none = filesystem::perms::none;
-    output << ((perms & filesystem::perms::owner_read) != none ? "r" : "-");
-    output << ((perms & filesystem::perms::owner_write) != none ? "w" : "-");
-    output << ((perms & filesystem::perms::owner_exec) != none ? "x" : "-");
-    output << ((perms & filesystem::perms::group_read) != none ? "r" : "-");
-    output << ((perms & filesystem::perms::group_write) != none ? "w" : "-");
-    output << ((perms & filesystem::perms::group_exec) != none ? "x" : "-");
-    output << ((perms & filesystem::perms::others_read) != none ? "r" : "-");
-    output << ((perms & filesystem::perms::others_write) != none ? "w" : "-");
-    output << ((perms & filesystem::perms::others_exec) != none ? "x" : "-");
-    entry.perms = output.str();
-}
-
-void getOwner(Entry& entry)
-{
-    struct stat info;
-    const auto path = entry.path.c_str();
-    if(stat(path, &info) != 0)
-        entry.owner = "NULL";
-    const struct passwd *pw = getpwuid(info.st_uid);
-    const struct group  *gr = getgrgid(info.st_gid);
-    stringstream output;
-    // get owner name
-    if(pw != 0)
-        output << pw->pw_name;
-    // get group name
-    if(gr != 0)
-        output << " " << gr->gr_name;
-    entry.owner = output.str();
-}
-
-void getSize(Entry& entry)
-{
-    // skip for directories
-    if(entry.isDirectory)
-    {
-        entry.size = "";
+    {
+        // -s only needs the type, which the listing usually has
+        struct stat typeInfo;
+        if(entry.type == DT_UNKNOWN && 
+            fstatat(dirFd, name, &typeInfo, AT_SYMLINK_NOFOLLOW) == 0)
+            entry.type = IFTODT(typeInfo.st_mode);
+        entry.isDirectory = entry.type == DT_DIR;
+        entry.isSymlink = entry.type == DT_LNK;
+    }
+    if(!entry.isSymlink)
         return;
+    struct stat target;
+    entry.isDirectory = fstatat(dirFd, name, &target, 0) == 0 && 
+        S_ISDIR(target.st_mode);
+    if(!tackS)
+        readLinkTarget(dirFd, entry);
+}
+
+bool uringSupportsStatx(int ringFd)
+{
+    const size_t probeSize = sizeof(io_uring_probe) + 
+        256 * sizeof(io_uring_probe_op);
+    vector<uint64_t> storage(probeSize / sizeof(uint64_t) + 1, 0);
+    auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+    if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, 
+        probe, 256) != 0)
+        return false;
+    return probe->ops_len > IORING_OP_STATX && 
+        (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+bool setupUring(unsigned depth)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const auto ringFd = static_cast<int>(
+        syscall(__NR_io_uring_setup, depth, &params));
+    if(ringFd < 0)
+        return false;
+    if(!uringSupportsStatx(ringFd))
+    {
+        close(ringFd);
+        return false;
     }
-    const auto fileSize = filesystem::file_size(entry.path);
-    unsigned long unitIndex = 0;
-    stringstream output;
-    if(fileSize < 1024)
-        output << fileSize;
-    else
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + 
+        params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(singleMap)
+        sqSize = cqSize = max(sqSize, cqSize);
+    void* sqRing = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    void* cqRing = singleMap ? sqRing : mmap(nullptr, cqSize, 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, 
+        IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, 
+        IORING_OFF_SQES);
+    if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
     {
-        double roundedFileSize = static_cast<double>(fileSize);
-        while(roundedFileSize > 1024.0 && unitIndex < 5)
+        close(ringFd);
+        return false;
+    }
+    auto* sq = static_cast<char*>(sqRing);
+    auto* cq = static_cast<char*>(cqRing);
+    uring.fd = ringFd;
+    uring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    uring.sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    uring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    uring.sqes = static_cast<io_uring_sqe*>(sqes);
+    uring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    uring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    uring.cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    uring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+void queueStatx(int dirFd, const Entry& entry, StatxSlot& slot, 
+    uint64_t slotIndex)
+{
+    const unsigned tail = *uring.sqTail;
+    const unsigned index = tail & *uring.sqMask;
+    io_uring_sqe* sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirFd;
+    sqe->addr = reinterpret_cast<uint64_t>(entry.fileName.c_str());
+    sqe->len = statxMask;
+    sqe->off = reinterpret_cast<uint64_t>(&slot.info);
+    sqe->statx_flags = slot.follow ? AT_NO_AUTOMOUNT : 
+        (AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT);
+    sqe->user_data = slotIndex;
+    uring.sqArray[index] = index;
+    __atomic_store_n(uring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    uring.pending++;
+}
+
+// returns false if the ring stopped working, the caller falls back
+bool waitCompletion(io_uring_cqe& completion)
+{
+    while(true)
+    {
+        const unsigned head = *uring.cqHead;
+        if(head != __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE))
         {
-            roundedFileSize /= 1024.0;
-            unitIndex++;
+            completion = uring.cqes[head & *uring.cqMask];
+            __atomic_store_n(uring.cqHead, head + 1, __ATOMIC_RELEASE);
+            return true;
         }
-        output << fixed << setprecision(2) << roundedFileSize; 
+        const long submitted = syscall(__NR_io_uring_enter, uring.fd, 
+            uring.pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if(submitted < 0 && errno != EINTR)
+            return false;
+        if(submitted > 0)
+            uring.pending -= static_cast<unsigned>(submitted);
     }
-    output << sizeUnits[unitIndex];
-    entry.size = output.str();
 }
 
-void getDirectoryName(Entry& entry)
+// keeps up to tackJ statx requests in the ring, symlinks get a second
+// one that follows them. returns false if nothing could be done this way
+bool fetchMetadataUring(int dirFd, vector<Entry>& entries)
 {
-    stringstream output;
-    if(tackS)
+    const auto depth = static_cast<unsigned>(min(tackJ, 4096UL));
+    if(uring.fd < 0 && !setupUring(depth))
+        return false;
+    vector<StatxSlot> slots(depth);
+    vector<uint64_t> freeSlots;
+    for(uint64_t slot = depth; slot > 0; slot--)
+        freeSlots.push_back(slot - 1);
+    size_t next = 0;
+    while(next < entries.size() || freeSlots.size() < depth)
+    {
+        while(next < entries.size() && !freeSlots.empty())
+        {
+            const uint64_t slot = freeSlots.back();
+            freeSlots.pop_back();
+            slots[slot].entry = next;
+            slots[slot].follow = false;
+            queueStatx(dirFd, entries[next++], slots[slot], slot);
+        }
+        io_uring_cqe completion;
+        if(!waitCompletion(completion))
+        {
+            // requests may still be in flight, so keep the ring from being reused
+            cerr << "ERROR: io_uring failed: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        StatxSlot& slot = slots[completion.user_data];
+        Entry& entry = entries[slot.entry];
+        if(slot.follow)
+            entry.isDirectory = completion.res == 0 && 
+                S_ISDIR(slot.info.stx_mode);
+        else if(completion.res != 0)
+            // let the plain path decide what an entry it cannot stat shows
+            getMetadata(dirFd, entry);
+        else
+        {
+            storeStatx(entry, slot.info);
+            if(entry.isSymlink)
+            {
+                readLinkTarget(dirFd, entry);
+                slot.follow = true;
+                queueStatx(dirFd, entry, slot, completion.user_data);
+                continue;
+            }
+        }
+        freeSlots.push_back(completion.user_data);
+    }
+    return true;
+}
+
+void fetchMetadataThreaded(int dirFd, vector<Entry>& entries)
+{
+    atomic<size_t> next(0);
+    const auto work = [&] {
+        while(true)
+        {
+            const size_t start = next.fetch_add(metadataBatch);
+            if(start >= entries.size())
+                return;
+            const size_t end = min(start + metadataBatch, entries.size());
+            for(size_t i = start; i < end; i++)
+                getMetadata(dirFd, entries[i]);
+        }
+    };
+    const size_t batches = (entries.size() + metadataBatch - 1) / metadataBatch;
+    vector<thread> workers;
+    for(size_t j = 1; j < min(static_cast<size_t>(tackJ), batches); j++)
+        workers.emplace_back(work);
+    work();
+    for(auto& worker : workers)
+        worker.join();
+}
+
+// fills every entry in place, so the order of the vector is untouched
+void fetchMetadata(int dirFd, vector<Entry>& entries)
+{
+    if(tackJ <= 1 || entries.size() < metadataBatch)
     {
-        output << BOLD + WHITE << entry.path.filename().string() 
-            << NORMAL + WHITE;
-        entry.name = output.str();
+        for(auto& entry : entries)
+            getMetadata(dirFd, entry);
         return;
     }
-    if(entry.isSymlink)
+    // -s only needs types, which are mostly known without a stat
+    if(needsStatx() && fetchMetadataUring(dirFd, entries))
+        return;
+    fetchMetadataThreaded(dirFd, entries);
+}
+
+void writeAll(const char* data, size_t length)
+{
+    while(length > 0)
     {
-        output << BOLD + CYAN << entry.path.filename().string() 
-            << NORMAL + WHITE << " -> ";
-        output << BOLD + BLUE << filesystem::read_symlink(entry.path) 
-            << NORMAL + WHITE;
+        const ssize_t written = write(STDOUT_FILENO, data, length);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            cerr << "ERROR: write failed: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
     }
+}
+
+void flushOutput()
+{
+    writeAll(outputBuffer, outputLength);
+    outputLength = 0;
+}
+
+void appendOutput(string_view data)
+{
+    if(outputLength + data.size() > outputSize)
+    {
+        flushOutput();
+        if(data.size() >= outputSize)
+        {
+            writeAll(data.data(), data.size());
+            return;
+        }
+    }
+    memcpy(outputBuffer + outputLength, data.data(), data.size());
+    outputLength += data.size();
+}
+
+void appendPadding(size_t count)
+{
+    static const string spaces(256, ' ');
+    for(; count > spaces.size(); count -= spaces.size())
+        appendOutput(spaces);
+    appendOutput(string_view(spaces).substr(0, count));
+}
+
+// link targets are printed in quotes, as filesystem::path did
+void appendQuoted(string_view text)
+{
+    appendOutput("\"");
+    size_t start = 0;
+    for(size_t i = 0; i < text.size(); i++)
+    {
+        if(text[i] != '"' && text[i] != '\\')
+            continue;
+        appendOutput(text.substr(start, i - start));
+        appendOutput("\\");
+        start = i;
+    }
+    appendOutput(text.substr(start));
+    appendOutput("\"");
+}
+
+void appendPermissions(const Entry& entry)
+{
+    char text[10];
+    if(entry.isSymlink)
+        text[0] = 'l';
+    else if(entry.isDirectory)
+        text[0] = 'd';
     else
-        output << BOLD + BLUE << entry.path.filename().string() 
-            << NORMAL + WHITE;
-    entry.name = output.str();
+        text[0] = '-';
+    for(unsigned digit = 0; digit < 3; digit++)
+    {
+        const auto& bits = permissionBits[(entry.mode >> (6 - 3 * digit)) & 7];
+        for(unsigned bit = 0; bit < 3; bit++)
+            text[1 + 3 * digit + bit] = entry.hasInfo ? bits[bit] : '?';
+    }
+    appendOutput(string_view(text, sizeof(text)));
 }
 
-void getFileName(Entry& entry)
+void appendName(const Entry& entry)
 {
     if(tackS)
     {
-        entry.name = entry.path.filename().string();
+        if(!entry.isDirectory)
+            appendOutput(entry.fileName);
+        else
+        {
+            appendOutput(boldWhite);
+            appendOutput(entry.fileName);
+            appendOutput(normalWhite);
+        }
         return;
-    } 
-    stringstream output;
-    if(entry.isSymlink)
-    {
-        output << NORMAL + CYAN << entry.path.filename().string() 
-            << NORMAL + WHITE << " -> ";
-        output << NORMAL + MAGENTA << filesystem::read_symlink(entry.path) 
-            << NORMAL + WHITE;
     }
+    appendOutput(entry.isSymlink ? (entry.isDirectory ? boldCyan : normalCyan) : 
+        (entry.isDirectory ? boldBlue : normalMagenta));
+    appendOutput(entry.fileName);
+    appendOutput(normalWhite);
+    if(!entry.isSymlink)
+        return;
+    appendOutput(" -> ");
+    appendOutput(entry.isDirectory ? boldBlue : normalMagenta);
+    appendQuoted(entry.linkTarget);
+    appendOutput(normalWhite);
+}
+
+uint32_t ownerText(uint32_t uid, uint32_t gid)
+{
+    const uint64_t key = (static_cast<uint64_t>(uid) << 32) | gid;
+    auto found = lower_bound(columns.ownerIndex.begin(), 
+        columns.ownerIndex.end(), make_pair(key, 0U));
+    if(found != columns.ownerIndex.end() && found->first == key)
+        return found->second;
+    const string& user = lookupName(userNames, uid, [](uint32_t id) { 
+        const struct passwd *pw = getpwuid(id);
+        return (pw != 0) ? string(pw->pw_name) : string(); });
+    const string& group = lookupName(groupNames, gid, [](uint32_t id) { 
+        const struct group *gr = getgrgid(id);
+        return (gr != 0) ? string(gr->gr_name) : string(); });
+    // a missing group leaves just the user, as getOwner always did
+    columns.owners.push_back(group.empty() ? user : user + " " + group);
+    const auto index = static_cast<uint32_t>(columns.owners.size() - 1);
+    columns.ownerIndex.insert(found, make_pair(key, index));
+    return index;
+}
+
+// sizes under 1KB are whole bytes, larger ones have two decimals
+size_t formatSize(uint64_t fileSize, char* text)
+{
+    unsigned long unitIndex = 0;
+    char* end;
+    if(fileSize < 1024)
+        end = to_chars(text, text + sizeTextMax, fileSize).ptr;
     else
-        output << NORMAL + MAGENTA << entry.path.filename().string() 
-            << NORMAL + WHITE;
-    entry.name = output.str();
+    {
+        double roundedFileSize = static_cast<double>(fileSize);
+        while(roundedFileSize > 1024.0 && unitIndex < sizeUnits.size() - 1)
+        {
+            roundedFileSize /= 1024.0;
+            unitIndex++;
+        }
+        end = to_chars(text, text + sizeTextMax - 2, roundedFileSize, 
+            chars_format::fixed, 2).ptr;
+    }
+    memcpy(end, sizeUnits[unitIndex].data(), 2);
+    return static_cast<size_t>(end + 2 - text);
 }
 
-void populateStructs(vector<Entry>& entries)
+void fillColumns(const vector<Entry>& entries)
 {
-    for(auto& entry : entries)
+    columns.owner.resize(entries.size());
+    columns.size.resize(entries.size());
+    columns.sizeLength.resize(entries.size());
+    for(size_t i = 0; i < entries.size(); i++)
     {
-        if(!tackS)
+        const Entry& entry = entries[i];
+        if(!entry.hasInfo)
         {
-            getPermissions(entry);
-            getOwner(entry);
-            getSize(entry);
+            columns.owner[i] = 0;
+            columns.sizeLength[i] = 0;
+            continue;
         }
-        if(entry.isDirectory)
-            getDirectoryName(entry);
-        else
-            getFileName(entry);
+        columns.owner[i] = ownerText(entry.uid, entry.gid);
+        // skip sizes for directories
+        columns.sizeLength[i] = entry.isDirectory ? 0 : 
+            static_cast<uint8_t>(formatSize(entry.bytes, columns.size[i].data()));
     }
 }
 
-void printOutput(vector<Entry>& entries)
+void printOutput(const vector<Entry>& entries)
 {
     // print simplified output
     if(tackS)
     {
-        for(auto& entry : entries)
+        for(const auto& entry : entries)
         {
-            cout << entry.name << "\n";
+            appendName(entry);
+            appendOutput("\n");
         }
         return;
     }
-    // get column widths
-    unsigned long permWidth = 0;
-    unsigned long ownerWidth = 0;
-    unsigned long sizeWidth = 0;
-    for(auto& entry : entries)
+    fillColumns(entries);
+    // get column widths, permissions are always ten characters
+    size_t& ownerWidth = columns.ownerWidth;
+    size_t& sizeWidth = columns.sizeWidth;
+    for(size_t i = 0; i < entries.size(); i++)
     {
-        permWidth = max(entry.perms.length(), permWidth);
-        ownerWidth = max(entry.owner.length(), ownerWidth);
-        sizeWidth = max(entry.size.length(), sizeWidth);
+        ownerWidth = max(columns.owners[columns.owner[i]].size(), ownerWidth);
+        sizeWidth = max(static_cast<size_t>(columns.sizeLength[i]), sizeWidth);
     }
     // print formatted output
-    for(auto& entry : entries)
+    for(size_t i = 0; i < entries.size(); i++)
     {
-        cout << left << setw(static_cast<int>(permWidth) + 1) << entry.perms;
-        cout << left << setw(static_cast<int>(ownerWidth) + 1) << entry.owner;
-        cout << right << setw(static_cast<int>(sizeWidth)) << entry.size << " ";
-        cout << entry.name << "\n";
+        appendPermissions(entries[i]);
+        appendOutput(" ");
+        const string& owner = columns.owners[columns.owner[i]];
+        appendOutput(owner);
+        appendPadding(ownerWidth + 1 - owner.size());
+        appendPadding(sizeWidth - columns.sizeLength[i]);
+        appendOutput(string_view(columns.size[i].data(), columns.sizeLength[i]));
+        appendOutput(" ");
+        appendName(entries[i]);
+        appendOutput("\n");
     }
 }
 
@@ -204,13 +722,43 @@ void printUsage(bool badFlag, bool badPath, string problem)
         cerr << "ERROR: Unrecognized flag \"" << problem << "\"\n";
     else if(badPath)
         cerr << "ERROR: Unrecognized file \"" << problem << "\"\n";
-    cout << "Usage: ellis [-ash] [path]\n";
+    cout << "Usage: ellis [-ahPrRsStU] [-j n] [--head n] [--window n] [path]\n";
     cout << "   -a : show hidden files\n";
     cout << "   -s : simple - don't show file attributes, colors, or follow symlinks\n";
     cout << "   -h : show help\n";
+    cout << "   -j n : keep n metadata requests in flight, or list n directories at once with -R\n";
+    cout << "   -P : take owner names only from /etc/passwd and /etc/group\n";
+    cout << "   -S : sort by size, largest first\n";
+    cout << "   -t : sort by modification time, newest first\n";
+    cout << "   -r : reverse the sort order\n";
+    cout << "   -R : list subdirectories recursively\n";
+    cout << "   -U : unsorted - print entries in directory order as they are read\n";
+    cout << "   --head n : print only the first n entries\n";
+    cout << "   --window n : with -R, read at most n directories ahead of the output\n";
     exit((badFlag || badPath) ? 1 : 0);
 }
 
+bool isNumeric(string input) {
+    for (unsigned long i = 0; i < input.length(); i++)
+    {
+        if (!isdigit(input[i]))
+            return false;
+    }
+    return !input.empty();
+}
+
+int setLongFlag(int argc, int arg, char** argv)
+{
+    const string flag = argv[arg];
+    if(flag == "--head" && arg + 1 < argc && isNumeric(argv[arg + 1]))
+        tackHead = stoul(argv[++arg]);
+    else if(flag == "--window" && arg + 1 < argc && isNumeric(argv[arg + 1]))
+        tackWindow = stoul(argv[++arg]);
+    else
+        printUsage(true, false, flag);
+    return arg;
+}
+
 int getFlags(int argc, char** argv)
 {
     // if no arguments
@@ -220,7 +768,9 @@ int getFlags(int argc, char** argv)
     {
         for(int arg = 1; arg < argc; arg++)
         {
-            if(argv[arg][0] == '-')
+            if(argv[arg][0] == '-' && argv[arg][1] == '-')
+                arg = setLongFlag(argc, arg, argv);
+            else if(argv[arg][0] == '-')
             {
                 // set flags from arguments beginning with '-'
                 for(string::size_type charIndex = 1; 
@@ -230,8 +780,27 @@ int getFlags(int argc, char** argv)
                         printUsage(false, false, "");
                     else if(argv[arg][charIndex] == 'a')
                         tackA = true;
+                    else if(argv[arg][charIndex] == 'P')
+                        tackP = true;
                     else if(argv[arg][charIndex] == 's')
                         tackS = true;
+                    else if(argv[arg][charIndex] == 'U')
+                        tackU = true;
+                    else if(argv[arg][charIndex] == 'S')
+                        tackSize = true;
+                    else if(argv[arg][charIndex] == 't')
+                        tackTime = true;
+                    else if(argv[arg][charIndex] == 'r')
+                        tackR = true;
+                    else if(argv[arg][charIndex] == 'R')
+                        tackRecursive = true;
+                    else if(argv[arg][charIndex] == 'j')
+                    {
+                        if(arg + 1 >= argc || !isNumeric(argv[arg + 1]))
+                            printUsage(true, false, "j");
+                        tackJ = stoul(argv[++arg]);
+                        break;
+                    }
                     else
                         printUsage(true, false, string(1, argv[arg][charIndex]));
                 }
@@ -244,49 +813,384 @@ int getFlags(int argc, char** argv)
     }
 }
 
-bool entrySort(const Entry& e1, const Entry& e2) 
+// a name folded to lowercase once into the arena, with the directory
+// bit and its first bytes packed into prefix, so most comparisons are
+// a single integer compare
+struct SortKey {
+    uint64_t prefix;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t index;
+};
+
+// bytes of the folded name held in the key, below the directory bit
+const size_t keyBytes = 7;
+
+// a size or modification time taken out of the entry once, so finding
+// the top few of millions compares integers
+struct NumericKey {
+    int64_t value;
+    uint32_t nsec;
+    uint32_t index;
+};
+
+// sorts keys, or when limit is smaller only selects and sorts the first
+// limit of them, without ordering the rest
+template<typename Key, typename Less>
+void selectKeys(vector<Key>& keys, size_t limit, Less less)
 {
-    // sort directories before files
-    if(e1.isDirectory && !e2.isDirectory)
-        return true;
-    else if(!e1.isDirectory && e2.isDirectory)
-        return false;
-    // sort by name, case-insensitive
-    string name1 = e1.path.filename().string();
-    string name2 = e2.path.filename().string();
-    transform(name1.begin(), name1.end(), name1.begin(), ::tolower);
-    transform(name2.begin(), name2.end(), name2.begin(), ::tolower);
-    return (name1.compare(name2) < 0);
+    if(limit < keys.size())
+    {
+        nth_element(keys.begin(), keys.begin() + static_cast<long>(limit), 
+            keys.end(), less);
+        keys.resize(limit);
+    }
+    sort(keys.begin(), keys.end(), less);
 }
 
-vector<Entry> getDirectoryContents(string path)
+// returns the indices of the first limit of count names in case-insensitive
+// order, with any isLater ones after the rest, the order the old tolower'd
+// copies gave. reverse flips the names but keeps the groups in place
+template<typename Name, typename IsLater>
+vector<uint32_t> sortOrder(size_t count, Name name, IsLater isLater, 
+    size_t limit, bool reverse)
 {
-    vector<Entry> entries;
-    for(const auto& file : filesystem::directory_iterator(path))
+    string arena;
+    vector<SortKey> keys(count);
+    for(uint32_t i = 0; i < count; i++)
     {
+        const auto text = name(i);
+        SortKey& key = keys[i];
+        key.prefix = isLater(i) ? (1ULL << 63) : 0;
+        key.offset = static_cast<uint32_t>(arena.size());
+        key.length = static_cast<uint32_t>(text.size());
+        key.index = i;
+        for(size_t c = 0; c < text.size(); c++)
+        {
+            const auto folded = static_cast<unsigned char>(
+                tolower(static_cast<unsigned char>(text[c])));
+            arena += static_cast<char>(folded);
+            if(c < keyBytes)
+                key.prefix |= static_cast<uint64_t>(folded) << (8 * (keyBytes - 1 - c));
+        }
+    }
+    const string_view folded(arena);
+    selectKeys(keys, limit, [&](const SortKey& k1, const SortKey& k2) {
+        if((k1.prefix >> 63) != (k2.prefix >> 63))
+            return k1.prefix < k2.prefix;
+        const SortKey& first = reverse ? k2 : k1;
+        const SortKey& second = reverse ? k1 : k2;
+        if(first.prefix != second.prefix)
+            return first.prefix < second.prefix;
+        return folded.substr(first.offset, first.length) < 
+            folded.substr(second.offset, second.length);
+    });
+    vector<uint32_t> order(keys.size());
+    for(size_t i = 0; i < keys.size(); i++)
+        order[i] = keys[i].index;
+    return order;
+}
+
+// the first limit entries by size or time, largest or newest first, ties
+// by name. directories are not grouped, and -r flips the whole order
+vector<uint32_t> numericOrder(const vector<Entry>& entries, size_t limit)
+{
+    vector<NumericKey> keys(entries.size());
+    for(uint32_t i = 0; i < entries.size(); i++)
+    {
+        const Entry& entry = entries[i];
+        if(tackSize)
+            keys[i] = { static_cast<int64_t>(entry.bytes), 0, i };
+        else
+            keys[i] = { entry.modified, entry.modifiedNsec, i };
+    }
+    const auto before = [&](const NumericKey& k1, const NumericKey& k2) {
+        if(k1.value != k2.value)
+            return k1.value > k2.value;
+        if(k1.nsec != k2.nsec)
+            return k1.nsec > k2.nsec;
+        return entries[k1.index].fileName < entries[k2.index].fileName;
+    };
+    selectKeys(keys, limit, [&](const NumericKey& k1, const NumericKey& k2) {
+        return tackR ? before(k2, k1) : before(k1, k2); });
+    vector<uint32_t> order(keys.size());
+    for(size_t i = 0; i < keys.size(); i++)
+        order[i] = keys[i].index;
+    return order;
+}
+
+template<typename T>
+void applyOrder(vector<T>& items, const vector<uint32_t>& order)
+{
+    vector<T> sorted;
+    sorted.reserve(items.size());
+    for(const uint32_t index : order)
+        sorted.push_back(move(items[index]));
+    items.swap(sorted);
+}
+
+// directories before files, then by name, case-insensitive, unless -S
+// or -t. only the entries --head keeps are put in order
+void sortEntries(vector<Entry>& entries)
+{
+    if(tackSize || tackTime)
+    {
+        applyOrder(entries, numericOrder(entries, tackHead));
+        return;
+    }
+    applyOrder(entries, sortOrder(entries.size(), 
+        [&](size_t i) { return string_view(entries[i].fileName); }, 
+        [&](size_t i) { return !entries[i].isDirectory; }, tackHead, tackR));
+}
+
+bool isDotEntry(const char* name)
+{
+    return name[0] == '.' && (name[1] == '\0' || 
+        (name[1] == '.' && name[2] == '\0'));
+}
+
+// appends entries until entries holds limit of them, returns false
+// once the directory has no more
+bool readEntries(DirectoryStream& stream, vector<Entry>& entries, size_t limit)
+{
+    while(entries.size() < limit)
+    {
+        if(stream.offset >= stream.bytes)
+        {
+            stream.bytes = syscall(SYS_getdents64, stream.fd, direntBuffer, 
+                direntBufferSize);
+            stream.offset = 0;
+            if(stream.bytes <= 0)
+                return false;
+        }
+        const auto* file = 
+            reinterpret_cast<const LinuxDirent64*>(direntBuffer + stream.offset);
+        stream.offset += file->d_reclen;
         // skip hidden files unless -a specified
-        if(!tackA && file.path().filename().string()[0] == '.')
+        if(isDotEntry(file->d_name) || (!tackA && file->d_name[0] == '.'))
             continue;
-        Entry temp;
-        temp.path = file.path();
-        temp.isDirectory = file.is_directory();
-        temp.isSymlink = file.is_symlink();
-        entries.push_back(temp);
+        Entry temp{};
+        temp.fileName = file->d_name;
+        temp.type = file->d_type;
+        entries.push_back(move(temp));
     }
-    sort(entries.begin(), entries.end(), entrySort);
+    return true;
+}
+
+vector<Entry> getDirectoryContents(int dirFd)
+{
+    vector<Entry> entries;
+    DirectoryStream stream{ dirFd };
+    readEntries(stream, entries, SIZE_MAX);
+    fetchMetadata(dirFd, entries);
+    sortEntries(entries);
     return entries;
 }
 
+// -U prints each batch as soon as it is read and stat'ed, so memory
+// does not depend on the size of the directory
+void streamDirectoryContents(int dirFd)
+{
+    vector<Entry> batch;
+    batch.reserve(streamBatch);
+    DirectoryStream stream{ dirFd };
+    bool more = true;
+    // --head stops the reading early
+    for(size_t left = tackHead; more && left > 0; left -= batch.size())
+    {
+        batch.clear();
+        more = readEntries(stream, batch, min(streamBatch, left));
+        fetchMetadata(dirFd, batch);
+        printOutput(batch);
+        flushOutput();
+    }
+}
+
+string joinPath(const string& parent, const string& name)
+{
+    if(!parent.empty() && parent.back() == '/')
+        return parent + name;
+    return parent + "/" + name;
+}
+
+// each worker lists one directory at a time, so metadata is fetched
+// serially here rather than through the shared ring
+void fillListing(Listing& listing)
+{
+    if(listing.fd < 0)
+        listing.fd = openat(listing.parent->fd, listing.name.c_str(), 
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(listing.fd < 0)
+    {
+        listing.error = errno;
+        return;
+    }
+    DirectoryStream stream{ listing.fd };
+    readEntries(stream, listing.entries, tackU ? tackHead : SIZE_MAX);
+    for(auto& entry : listing.entries)
+        getMetadata(listing.fd, entry);
+    if(!tackU)
+        sortEntries(listing.entries);
+    // symlinked directories are shown but not entered, as ls -R does
+    for(const auto& entry : listing.entries)
+    {
+        if(!entry.isDirectory || entry.isSymlink)
+            continue;
+        auto child = make_shared<Listing>();
+        child->parent = &listing;
+        child->name = entry.fileName;
+        child->path = joinPath(listing.path, entry.fileName);
+        listing.children.push_back(move(child));
+    }
+}
+
+void finishListing(const shared_ptr<Listing>& listing)
+{
+    lock_guard<mutex> guard(prefetch.lock);
+    listing->state = Listing::listed;
+    prefetch.ahead++;
+    // children go to the front so the queue stays close to output order
+    for(auto child = listing->children.rbegin(); 
+        prefetch.workers && child != listing->children.rend(); child++)
+    {
+        prefetch.waiting.push_front(*child);
+        prefetch.work.notify_one();
+    }
+    prefetch.listed.notify_one();
+}
+
+void prefetchListings()
+{
+    unique_lock<mutex> guard(prefetch.lock);
+    while(true)
+    {
+        prefetch.work.wait(guard, [] { return prefetch.finished || 
+            (!prefetch.waiting.empty() && prefetch.ahead < tackWindow); });
+        if(prefetch.finished)
+            return;
+        const shared_ptr<Listing> listing = prefetch.waiting.front().lock();
+        prefetch.waiting.pop_front();
+        // already printed, or the printing thread got to it first
+        if(!listing || listing->state != Listing::waiting)
+            continue;
+        listing->state = Listing::listing;
+        guard.unlock();
+        fillListing(*listing);
+        finishListing(listing);
+        guard.lock();
+    }
+}
+
+void awaitListing(const shared_ptr<Listing>& listing)
+{
+    unique_lock<mutex> guard(prefetch.lock);
+    // nobody has started it, so list it here rather than wait on a worker
+    if(listing->state == Listing::waiting)
+    {
+        listing->state = Listing::listing;
+        guard.unlock();
+        fillListing(*listing);
+        finishListing(listing);
+        guard.lock();
+    }
+    prefetch.listed.wait(guard, 
+        [&] { return listing->state == Listing::listed; });
+    prefetch.ahead--;
+    prefetch.work.notify_one();
+}
+
+// prints one section of -R, then drops its entries since only the
+// subdirectories are needed from here on
+void printListing(Listing& listing, bool first)
+{
+    if(!first)
+        appendOutput("\n");
+    appendOutput(listing.path);
+    appendOutput(":\n");
+    if(listing.error != 0)
+    {
+        flushOutput();
+        cerr << "ERROR: cannot open \"" << listing.path << "\": " << 
+            strerror(listing.error) << "\n";
+        return;
+    }
+    // each section is aligned on its own
+    columns.ownerWidth = 0;
+    columns.sizeWidth = 0;
+    printOutput(listing.entries);
+    vector<Entry>().swap(listing.entries);
+}
+
+// sections in ls -R order, each directory followed by its subdirectories
+// depth first, while workers list up to tackWindow directories ahead
+void printRecursive(int dirFd, const string& path)
+{
+    // every directory on the stack and in the window holds an fd
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    auto root = make_shared<Listing>();
+    root->path = path;
+    root->fd = dirFd;
+    // the printing thread is the first of the -j listers
+    vector<thread> workers;
+    prefetch.workers = tackJ > 1 && tackWindow > 0;
+    for(unsigned long j = 1; prefetch.workers && j < tackJ; j++)
+        workers.emplace_back(prefetchListings);
+    awaitListing(root);
+    printListing(*root, true);
+    vector<Frame> stack;
+    stack.push_back({ move(root), 0 });
+    while(!stack.empty())
+    {
+        Frame& frame = stack.back();
+        Listing& listing = *frame.listing;
+        if(frame.cursor == listing.children.size())
+        {
+            // every child has been opened by now
+            if(listing.fd >= 0)
+                close(listing.fd);
+            stack.pop_back();
+            continue;
+        }
+        // moving it out also drops it from the prefetch queue once printed
+        shared_ptr<Listing> child = move(listing.children[frame.cursor++]);
+        awaitListing(child);
+        printListing(*child, false);
+        stack.push_back({ move(child), 0 });
+    }
+    {
+        lock_guard<mutex> guard(prefetch.lock);
+        prefetch.finished = true;
+    }
+    prefetch.work.notify_all();
+    for(auto& worker : workers)
+        worker.join();
+}
+
 int main(int argc, char** argv)
 {
     const int pathIndex = getFlags(argc, argv);
     const string path = (pathIndex == -1) ? 
         filesystem::current_path().string() : 
         static_cast<string>(argv[pathIndex]);
-    if (!filesystem::exists(path))
+    const int dirFd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0)
         printUsage(false, true, path);
-    vector<Entry> entries = getDirectoryContents(path);
-    populateStructs(entries);
-    printOutput(entries);
+    if(tackP)
+    {
+        preloadNames(userNames, "/etc/passwd");
+        preloadNames(groupNames, "/etc/group");
+    }
+    if(tackRecursive)
+        printRecursive(dirFd, path);
+    else if(tackU)
+        streamDirectoryContents(dirFd);
+    else
+        printOutput(getDirectoryContents(dirFd));
+    flushOutput();
     return 0;
 }
\ No newline at end of file
@@ -2,16 +2,106 @@
 * Kat - a take on 'cat'
 *
 * Compilation:
-* clang++ -std=c++17 -O2 Kat.cpp -o kat (with added warnings)
+* clang++ -std=c++17 -O2 -pthread Kat.cpp -o kat (with added warnings)
 */
 
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+bool tackN = false;
+bool tackB = false;
+bool tackS = false;
+unsigned long tackJ = 0;
+bool tackU = false;
+
+// size of the fallback read/write buffer, and the largest request
+// handed to the kernel in a single copy call
+const size_t bufferSize = 128 * 1024;
+const size_t kernelChunk = 1UL << 30;
+alignas(4096) char buffer[bufferSize];
+
+// line mode state, carried across files like cat does
+alignas(4096) char outputBuffer[bufferSize];
+size_t outputLength = 0;
+uint32_t newlineOffsets[bufferSize];
+uint64_t lineNumber = 0;
+unsigned long blankLines = 0;
+bool atLineStart = true;
+
+enum class CopyResult { done, unsupported };
+
+// reads kept in flight by the io_uring engine, one buffer each
+const unsigned uringDepth = 8;
+
+struct Uring {
+    int fd = -1;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    unsigned pending = 0;
+};
+
+enum class UringState { unchecked, available, unavailable };
+UringState uringState = UringState::unchecked;
+Uring uring;
+
+struct UringBuffer {
+    char* data;
+    off_t offset;
+    size_t wanted;
+    size_t filled;
+    size_t written;
+    bool readDone;
+};
+
+// files read ahead of the writer by -j, each slot holds the head of one file
+const size_t ringSlots = 32;
+
+struct Slot {
+    vector<char> data;
+    size_t length = 0;
+    // left open when the file did not fit, the writer streams the rest
+    int fd = -1;
+    int error = 0;
+    struct stat info;
+    bool ready = false;
+};
+
+struct Pipeline {
+    const vector<string>& paths;
+    vector<Slot> ring;
+    size_t nextPath = 0;
+    size_t writtenPaths = 0;
+    mutex lock;
+    condition_variable slotFree;
+    condition_variable slotReady;
+};
+
 void printUsage(string errorType, string problem)
 {
     if(errorType == "badFlag")
@@ -22,11 +112,53 @@ void printUsage(string errorType, string problem)
         cerr << "ERROR: No file specified\n";
     else if(errorType == "isDir")
         cerr << "ERROR: \"" << problem << "\" is directory\n";
-    cout << "Usage: cat [-h] file1 [file2..fileN]\n";
+    cout << "Usage: cat [-bhnsu] [-j n] file1 [file2..fileN]\n";
+    cout << "   -b : number non-blank lines\n";
     cout << "   -h : show help\n";
+    cout << "   -j n : read ahead with n threads\n";
+    cout << "   -n : number all lines\n";
+    cout << "   -s : squeeze repeated blank lines\n";
+    cout << "   -u : copy with io_uring when the kernel supports it\n";
     exit((errorType == "") ? 0 : 1);
 }
 
+bool isNumeric(string input) {
+    for (unsigned long i = 0; i < input.length(); i++)
+    {
+        if (!isdigit(input[i]))
+            return false;
+    }
+    return !input.empty();
+}
+
+int setFlags(int argc, int arg, char** argv)
+{
+    for(string::size_type charIndex = 1; 
+        charIndex < string(argv[arg]).length(); charIndex++)
+    {
+        if(argv[arg][charIndex] == 'h')
+            printUsage("", "");
+        else if(argv[arg][charIndex] == 'b')
+            tackB = true;
+        else if(argv[arg][charIndex] == 'n')
+            tackN = true;
+        else if(argv[arg][charIndex] == 's')
+            tackS = true;
+        else if(argv[arg][charIndex] == 'u')
+            tackU = true;
+        else if(argv[arg][charIndex] == 'j')
+        {
+            if(arg + 1 >= argc || !isNumeric(argv[arg + 1]))
+                printUsage("badFlag", (arg + 1 < argc) ? argv[arg + 1] : "j");
+            tackJ = stoul(argv[++arg]);
+            break;
+        }
+        else
+            printUsage("badFlag", string(1, argv[arg][charIndex]));
+    }
+    return arg;
+}
+
 int getFlags(int argc, char** argv)
 {
     // if no arguments
@@ -38,15 +170,7 @@ int getFlags(int argc, char** argv)
         {
             if(argv[arg][0] == '-')
             {
-                // set flags from arguments beginning with '-'
-                for(string::size_type charIndex = 1; 
-                    charIndex < string(argv[arg]).length(); charIndex++)
-                {
-                    if(argv[arg][charIndex] == 'h')
-                        printUsage("", "");
-                    else
-                        printUsage("badFlag", string(1, argv[arg][charIndex]));
-                }
+                arg = setFlags(argc, arg, argv);
             }
             // return index of first non '-' argument
             else
@@ -61,25 +185,698 @@ vector<string> getPaths(int argc, char** argv, int pathIndex)
     vector<string> paths;
     for(int i = pathIndex; i < argc; i++)
     {
+        paths.push_back(argv[i]);
+        // readers check files as they open them when reading ahead
+        if(tackJ > 0)
+            continue;
         if (!filesystem::exists(argv[i]))
             printUsage("badFile", argv[i]);
         else if(filesystem::is_directory(argv[i]))
             printUsage("isDir", argv[i]);
-        paths.push_back(argv[i]);
     }
     return paths;
 }
 
-void printFiles(vector<string>& paths)
+void printError(string problem)
 {
-    for(auto& path : paths)
+    // used once output has started, so usage is not mixed into stdout
+    cerr << "ERROR: " << problem << "\n";
+    exit(1);
+}
+
+void writeAll(int outFd, const char* data, size_t length)
+{
+    while(length > 0)
+    {
+        const ssize_t written = write(outFd, data, length);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            printError(string("write failed: ") + strerror(errno));
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+}
+
+bool isUnsupported(int error)
+{
+    return error == EINVAL || error == ENOSYS || error == EXDEV || 
+        error == EOPNOTSUPP || error == EBADF;
+}
+
+// the kernel copy loops below all advance the file offsets themselves,
+// so when one gives up part way the next engine continues where it left off
+CopyResult copyRange(int inFd, int outFd)
+{
+    bool copiedAny = false;
+    while(true)
+    {
+        const ssize_t copied = copy_file_range(inFd, nullptr, outFd, nullptr, 
+            kernelChunk, 0);
+        if(copied > 0)
+            copiedAny = true;
+        else if(copied == 0)
+            // some pseudo filesystems report 0 instead of failing
+            return copiedAny ? CopyResult::done : CopyResult::unsupported;
+        else if(errno != EINTR)
+        {
+            if(isUnsupported(errno))
+                return CopyResult::unsupported;
+            printError(string("copy failed: ") + strerror(errno));
+        }
+    }
+}
+
+CopyResult copySendfile(int inFd, int outFd)
+{
+    bool copiedAny = false;
+    while(true)
+    {
+        const ssize_t copied = sendfile(outFd, inFd, nullptr, kernelChunk);
+        if(copied > 0)
+            copiedAny = true;
+        else if(copied == 0)
+            return copiedAny ? CopyResult::done : CopyResult::unsupported;
+        else if(errno != EINTR)
+        {
+            if(isUnsupported(errno))
+                return CopyResult::unsupported;
+            printError(string("copy failed: ") + strerror(errno));
+        }
+    }
+}
+
+CopyResult copySplice(int inFd, int outFd)
+{
+    bool copiedAny = false;
+    while(true)
+    {
+        const ssize_t copied = splice(inFd, nullptr, outFd, nullptr, 
+            kernelChunk, SPLICE_F_MORE);
+        if(copied > 0)
+            copiedAny = true;
+        else if(copied == 0)
+            return copiedAny ? CopyResult::done : CopyResult::unsupported;
+        else if(errno != EINTR)
+        {
+            if(isUnsupported(errno))
+                return CopyResult::unsupported;
+            printError(string("copy failed: ") + strerror(errno));
+        }
+    }
+}
+
+void copyBuffered(int inFd, int outFd)
+{
+    while(true)
+    {
+        const ssize_t bytesRead = read(inFd, buffer, bufferSize);
+        if(bytesRead == 0)
+            return;
+        if(bytesRead < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            printError(string("read failed: ") + strerror(errno));
+        }
+        writeAll(outFd, buffer, static_cast<size_t>(bytesRead));
+    }
+}
+
+bool uringSupportsReadWrite(int ringFd)
+{
+    const size_t probeSize = sizeof(io_uring_probe) + 
+        256 * sizeof(io_uring_probe_op);
+    vector<uint64_t> storage(probeSize / sizeof(uint64_t) + 1, 0);
+    auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+    if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, 
+        probe, 256) != 0)
+        return false;
+    return probe->ops_len > IORING_OP_WRITE && 
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0 && 
+        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+bool setupUring()
+{
+    // checked once, later files reuse the ring or go straight to the fallback
+    if(uringState != UringState::unchecked)
+        return uringState == UringState::available;
+    uringState = UringState::unavailable;
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const auto ringFd = static_cast<int>(
+        syscall(__NR_io_uring_setup, uringDepth * 2, &params));
+    if(ringFd < 0)
+        return false;
+    if((params.features & IORING_FEAT_RW_CUR_POS) == 0 || 
+        !uringSupportsReadWrite(ringFd))
+    {
+        close(ringFd);
+        return false;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + 
+        params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(singleMap)
+        sqSize = cqSize = max(sqSize, cqSize);
+    void* sqRing = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    void* cqRing = singleMap ? sqRing : mmap(nullptr, cqSize, 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, 
+        IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), 
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, 
+        IORING_OFF_SQES);
+    if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(ringFd);
+        return false;
+    }
+    auto* sq = static_cast<char*>(sqRing);
+    auto* cq = static_cast<char*>(cqRing);
+    uring.fd = ringFd;
+    uring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    uring.sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    uring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    uring.sqes = static_cast<io_uring_sqe*>(sqes);
+    uring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    uring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    uring.cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    uring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    uringState = UringState::available;
+    return true;
+}
+
+void queueUring(uint8_t opcode, int fd, char* data, size_t length, 
+    off_t offset, uint64_t userData)
+{
+    const unsigned tail = *uring.sqTail;
+    const unsigned index = tail & *uring.sqMask;
+    io_uring_sqe* sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(length);
+    sqe->off = static_cast<uint64_t>(offset);
+    sqe->user_data = userData;
+    uring.sqArray[index] = index;
+    __atomic_store_n(uring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    uring.pending++;
+}
+
+void queueRead(int inFd, UringBuffer& chunk, uint64_t bufferIndex)
+{
+    queueUring(IORING_OP_READ, inFd, chunk.data + chunk.filled, 
+        chunk.wanted - chunk.filled, chunk.offset + 
+        static_cast<off_t>(chunk.filled), bufferIndex << 1);
+}
+
+void queueWrite(int outFd, UringBuffer& chunk, uint64_t bufferIndex)
+{
+    // offset -1 writes at the current position, which also suits pipes
+    queueUring(IORING_OP_WRITE, outFd, chunk.data + chunk.written, 
+        chunk.filled - chunk.written, -1, (bufferIndex << 1) | 1);
+}
+
+io_uring_cqe waitCompletion()
+{
+    while(true)
+    {
+        const unsigned head = *uring.cqHead;
+        if(head != __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe cqe = uring.cqes[head & *uring.cqMask];
+            __atomic_store_n(uring.cqHead, head + 1, __ATOMIC_RELEASE);
+            return cqe;
+        }
+        const long submitted = syscall(__NR_io_uring_enter, uring.fd, 
+            uring.pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if(submitted < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            printError(string("io_uring failed: ") + strerror(errno));
+        }
+        uring.pending -= static_cast<unsigned>(submitted);
+    }
+}
+
+// reads of later chunks stay in flight while earlier chunks are written,
+// and writes are issued one at a time so they land in file order
+CopyResult copyUring(int inFd, const struct stat& inInfo, int outFd)
+{
+    if(!setupUring())
+        return CopyResult::unsupported;
+    static vector<char> storage;
+    storage.resize(uringDepth * bufferSize + 4096);
+    char* aligned = storage.data() + (4096 - 
+        reinterpret_cast<uintptr_t>(storage.data()) % 4096);
+    const off_t start = lseek(inFd, 0, SEEK_CUR);
+    if(start < 0)
+        return CopyResult::unsupported;
+    const off_t end = max(start, inInfo.st_size);
+    const auto chunkSize = static_cast<off_t>(bufferSize);
+    const uint64_t chunkCount = static_cast<uint64_t>(
+        (end - start + chunkSize - 1) / chunkSize);
+    UringBuffer chunks[uringDepth];
+    auto startChunk = [&](uint64_t chunk) {
+        UringBuffer& slot = chunks[chunk % uringDepth];
+        slot.data = aligned + (chunk % uringDepth) * bufferSize;
+        slot.offset = start + static_cast<off_t>(chunk) * chunkSize;
+        slot.wanted = static_cast<size_t>(
+            min(chunkSize, end - slot.offset));
+        slot.filled = 0;
+        slot.written = 0;
+        slot.readDone = false;
+        queueRead(inFd, slot, chunk % uringDepth);
+    };
+    for(uint64_t chunk = 0; chunk < min<uint64_t>(uringDepth, chunkCount); 
+        chunk++)
+        startChunk(chunk);
+    uint64_t nextWrite = 0;
+    bool writing = false;
+    off_t reached = start;
+    while(nextWrite < chunkCount)
+    {
+        UringBuffer& head = chunks[nextWrite % uringDepth];
+        if(!writing && head.readDone)
+        {
+            if(head.filled == 0)
+                break;
+            queueWrite(outFd, head, nextWrite % uringDepth);
+            writing = true;
+        }
+        const io_uring_cqe cqe = waitCompletion();
+        UringBuffer& slot = chunks[cqe.user_data >> 1];
+        const bool isWrite = (cqe.user_data & 1) != 0;
+        if(cqe.res < 0)
+        {
+            if(cqe.res == -EINTR || cqe.res == -EAGAIN)
+            {
+                if(isWrite)
+                    queueWrite(outFd, slot, cqe.user_data >> 1);
+                else
+                    queueRead(inFd, slot, cqe.user_data >> 1);
+                continue;
+            }
+            printError(string(isWrite ? "write" : "read") + " failed: " + 
+                strerror(-cqe.res));
+        }
+        const auto bytes = static_cast<size_t>(cqe.res);
+        if(!isWrite)
+        {
+            slot.filled += bytes;
+            // a file that shrank ends early, the final read below stops at EOF
+            if(bytes == 0)
+                slot.wanted = slot.filled;
+            if(slot.filled < slot.wanted)
+                queueRead(inFd, slot, cqe.user_data >> 1);
+            else
+                slot.readDone = true;
+            continue;
+        }
+        slot.written += bytes;
+        if(slot.written < slot.filled)
+        {
+            queueWrite(outFd, slot, cqe.user_data >> 1);
+            continue;
+        }
+        writing = false;
+        reached = slot.offset + static_cast<off_t>(slot.filled);
+        if(slot.filled < static_cast<size_t>(min(chunkSize, end - 
+            slot.offset)))
+            break;
+        if(nextWrite + uringDepth < chunkCount)
+            startChunk(nextWrite + uringDepth);
+        nextWrite++;
+    }
+    // drain reads still in flight after an early end before reusing buffers
+    for(uint64_t chunk = nextWrite + 1; chunk < min(nextWrite + uringDepth, 
+        chunkCount); chunk++)
     {
-        ifstream file(path);
-        while(file)
+        while(!chunks[chunk % uringDepth].readDone)
         {
-            cout << static_cast<char>(file.get());
+            const io_uring_cqe cqe = waitCompletion();
+            UringBuffer& slot = chunks[cqe.user_data >> 1];
+            slot.filled += static_cast<size_t>(max(cqe.res, 0));
+            if(cqe.res <= 0 || slot.filled >= slot.wanted)
+                slot.readDone = true;
+            else
+                queueRead(inFd, slot, cqe.user_data >> 1);
+        }
+    }
+    // anything appended since the size was taken is read normally
+    lseek(inFd, reached, SEEK_SET);
+    copyBuffered(inFd, outFd);
+    return CopyResult::done;
+}
+
+void copyFile(int inFd, const struct stat& inInfo, 
+    int outFd, const struct stat& outInfo)
+{
+    // kernel side copies only for regular files that report a size
+    if(S_ISREG(inInfo.st_mode) && inInfo.st_size > 0)
+    {
+        posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if(tackU && copyUring(inFd, inInfo, outFd) == CopyResult::done)
+            return;
+        if(S_ISREG(outInfo.st_mode) && 
+            copyRange(inFd, outFd) == CopyResult::done)
+            return;
+        if(S_ISFIFO(outInfo.st_mode) && 
+            copySplice(inFd, outFd) == CopyResult::done)
+            return;
+        if(copySendfile(inFd, outFd) == CopyResult::done)
+            return;
+    }
+    copyBuffered(inFd, outFd);
+}
+
+// scans data from start on, offsets stay relative to data so the vector
+// scanners can finish their last partial chunk with it
+size_t indexNewlinesFrom(const char* data, size_t start, size_t length, 
+    uint32_t* offsets)
+{
+    size_t count = 0;
+    for(size_t i = start; i < length; i++)
+    {
+        if(data[i] == '\n')
+            offsets[count++] = static_cast<uint32_t>(i);
+    }
+    return count;
+}
+
+// the newline scanners fill offsets with the position of every '\n' in
+// data and return how many were found
+size_t indexNewlinesScalar(const char* data, size_t length, uint32_t* offsets)
+{
+    return indexNewlinesFrom(data, 0, length, offsets);
+}
+
+#if defined(__x86_64__)
+size_t indexNewlinesSse2(const char* data, size_t length, uint32_t* offsets)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for(; i + 16 <= length; i += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(data + i));
+        auto mask = static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+        while(mask != 0)
+        {
+            offsets[count++] = static_cast<uint32_t>(i) + 
+                static_cast<uint32_t>(__builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    return count + indexNewlinesFrom(data, i, length, offsets + count);
+}
+
+__attribute__((target("avx2")))
+size_t indexNewlinesAvx2(const char* data, size_t length, uint32_t* offsets)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    for(; i + 32 <= length; i += 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(data + i));
+        auto mask = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+        while(mask != 0)
+        {
+            offsets[count++] = static_cast<uint32_t>(i) + 
+                static_cast<uint32_t>(__builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    return count + indexNewlinesFrom(data, i, length, offsets + count);
+}
+#endif
+
+using NewlineScanner = size_t (*)(const char*, size_t, uint32_t*);
+
+NewlineScanner selectNewlineScanner()
+{
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("avx2"))
+        return indexNewlinesAvx2;
+    return indexNewlinesSse2;
+#else
+    return indexNewlinesScalar;
+#endif
+}
+
+const NewlineScanner indexNewlines = selectNewlineScanner();
+
+void flushOutput()
+{
+    writeAll(STDOUT_FILENO, outputBuffer, outputLength);
+    outputLength = 0;
+}
+
+void appendOutput(const char* data, size_t length)
+{
+    if(outputLength + length > bufferSize)
+    {
+        flushOutput();
+        // large runs are written straight from the input buffer
+        if(length >= bufferSize)
+        {
+            writeAll(STDOUT_FILENO, data, length);
+            return;
+        }
+    }
+    memcpy(outputBuffer + outputLength, data, length);
+    outputLength += length;
+}
+
+void appendLineNumber()
+{
+    char digits[24];
+    const auto result = to_chars(digits, digits + sizeof(digits), ++lineNumber);
+    const auto length = static_cast<size_t>(result.ptr - digits);
+    if(outputLength + sizeof(digits) + 8 > bufferSize)
+        flushOutput();
+    // right aligned in six columns followed by a tab, as cat does
+    for(size_t pad = length; pad < 6; pad++)
+        outputBuffer[outputLength++] = ' ';
+    memcpy(outputBuffer + outputLength, digits, length);
+    outputLength += length;
+    outputBuffer[outputLength++] = '\t';
+}
+
+void processLines(const char* data, size_t length)
+{
+    const size_t count = indexNewlines(data, length, newlineOffsets);
+    // text is copied in runs that are only broken where a line number
+    // is inserted or a repeated blank line is dropped
+    size_t runStart = 0;
+    size_t lineStart = 0;
+    for(size_t n = 0; n <= count; n++)
+    {
+        const bool complete = (n < count);
+        const size_t lineEnd = complete ? newlineOffsets[n] + 1 : length;
+        if(lineEnd == lineStart)
+            break;
+        if(atLineStart)
+        {
+            const bool blank = complete && (lineEnd - lineStart == 1);
+            blankLines = blank ? blankLines + 1 : 0;
+            if(tackS && blankLines > 1)
+            {
+                appendOutput(data + runStart, lineStart - runStart);
+                runStart = lineEnd;
+            }
+            else if(tackB ? !blank : tackN)
+            {
+                appendOutput(data + runStart, lineStart - runStart);
+                appendLineNumber();
+                runStart = lineStart;
+            }
+        }
+        atLineStart = complete;
+        lineStart = lineEnd;
+    }
+    appendOutput(data + runStart, length - runStart);
+}
+
+void printLines(int inFd)
+{
+    while(true)
+    {
+        const ssize_t bytesRead = read(inFd, buffer, bufferSize);
+        if(bytesRead == 0)
+            return;
+        if(bytesRead < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            printError(string("read failed: ") + strerror(errno));
+        }
+        processLines(buffer, static_cast<size_t>(bytesRead));
+    }
+}
+
+void readFileHead(const string& path, Slot& slot)
+{
+    slot.length = 0;
+    slot.fd = -1;
+    slot.error = 0;
+    const int inFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(inFd < 0)
+    {
+        slot.error = errno;
+        return;
+    }
+    if(fstat(inFd, &slot.info) != 0 || S_ISDIR(slot.info.st_mode))
+    {
+        slot.error = S_ISDIR(slot.info.st_mode) ? EISDIR : errno;
+        close(inFd);
+        return;
+    }
+    while(slot.length < slot.data.size())
+    {
+        const ssize_t bytesRead = read(inFd, slot.data.data() + slot.length, 
+            slot.data.size() - slot.length);
+        if(bytesRead == 0)
+            break;
+        if(bytesRead < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            slot.error = errno;
+            close(inFd);
+            return;
+        }
+        slot.length += static_cast<size_t>(bytesRead);
+    }
+    if(slot.length == slot.data.size())
+        slot.fd = inFd;
+    else
+        close(inFd);
+}
+
+void readAhead(Pipeline& pipeline)
+{
+    while(true)
+    {
+        unique_lock<mutex> guard(pipeline.lock);
+        // stay at most one ring ahead of the writer
+        pipeline.slotFree.wait(guard, [&pipeline] {
+            return pipeline.nextPath >= pipeline.paths.size() || 
+                pipeline.nextPath < pipeline.writtenPaths + ringSlots;
+        });
+        if(pipeline.nextPath >= pipeline.paths.size())
+            return;
+        const size_t index = pipeline.nextPath++;
+        guard.unlock();
+        Slot& slot = pipeline.ring[index % ringSlots];
+        readFileHead(pipeline.paths[index], slot);
+        guard.lock();
+        slot.ready = true;
+        pipeline.slotReady.notify_one();
+    }
+}
+
+void writeSlot(const string& path, Slot& slot, const struct stat& outInfo)
+{
+    if(slot.error != 0)
+    {
+        flushOutput();
+        if(slot.error == EISDIR)
+            printError("\"" + path + "\" is directory");
+        else if(slot.error == ENOENT)
+            printError("Unrecognized file \"" + path + "\"");
+        printError("Could not read \"" + path + "\": " + strerror(slot.error));
+    }
+    if(S_ISREG(outInfo.st_mode) && slot.info.st_dev == outInfo.st_dev && 
+        slot.info.st_ino == outInfo.st_ino)
+        printError("\"" + path + "\" is the output file");
+    // small files are batched into the output buffer
+    if(tackN || tackB || tackS)
+        processLines(slot.data.data(), slot.length);
+    else
+        appendOutput(slot.data.data(), slot.length);
+    if(slot.fd < 0)
+        return;
+    if(tackN || tackB || tackS)
+        printLines(slot.fd);
+    else
+    {
+        flushOutput();
+        copyFile(slot.fd, slot.info, STDOUT_FILENO, outInfo);
+    }
+    close(slot.fd);
+}
+
+void printFilesPipelined(vector<string>& paths, const struct stat& outInfo)
+{
+    Pipeline pipeline{paths, vector<Slot>(ringSlots), 0, 0, {}, {}, {}};
+    for(auto& slot : pipeline.ring)
+        slot.data.resize(bufferSize);
+    vector<thread> readers;
+    for(unsigned long i = 0; i < tackJ; i++)
+        readers.emplace_back(readAhead, ref(pipeline));
+    // a single writer drains the ring in argument order
+    for(size_t index = 0; index < paths.size(); index++)
+    {
+        Slot& slot = pipeline.ring[index % ringSlots];
+        {
+            unique_lock<mutex> guard(pipeline.lock);
+            pipeline.slotReady.wait(guard, [&slot] { return slot.ready; });
+        }
+        writeSlot(paths[index], slot, outInfo);
+        {
+            lock_guard<mutex> guard(pipeline.lock);
+            slot.ready = false;
+            pipeline.writtenPaths = index + 1;
         }
+        pipeline.slotFree.notify_all();
+    }
+    for(auto& reader : readers)
+        reader.join();
+    flushOutput();
+}
+
+void printFiles(vector<string>& paths)
+{
+    struct stat outInfo;
+    if(fstat(STDOUT_FILENO, &outInfo) != 0)
+        printError(string("stat failed: ") + strerror(errno));
+    if(tackJ > 0)
+    {
+        printFilesPipelined(paths, outInfo);
+        return;
+    }
+    for(auto& path : paths)
+    {
+        const int inFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(inFd < 0)
+            printError("Could not open \"" + path + "\": " + strerror(errno));
+        struct stat inInfo;
+        if(fstat(inFd, &inInfo) != 0)
+            printError(string("stat failed: ") + strerror(errno));
+        // refuse to read a file into itself, which would never finish
+        if(S_ISREG(outInfo.st_mode) && inInfo.st_dev == outInfo.st_dev && 
+            inInfo.st_ino == outInfo.st_ino)
+            printError("\"" + path + "\" is the output file");
+        if(tackN || tackB || tackS)
+            printLines(inFd);
+        else
+            copyFile(inFd, inInfo, STDOUT_FILENO, outInfo);
+        close(inFd);
     }
+    flushOutput();
 }
 
 int main(int argc, char** argv)
@@ -2,22 +2,151 @@
 * Trey - a take on 'tree'
 *
 * Compilation:
-* clang++ -std=c++17 -O2 Trey.cpp -o trey (with added warnings)
+* clang++ -std=c++17 -O2 -pthread Trey.cpp -o trey (with added warnings)
 */
 
 #include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <fnmatch.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
 
 bool tackA = false;
 bool tackD = false;
+bool tackX = false;
+bool tackS = false;
+bool tackJson = false;
+bool tackZero = false;
+// 0 means no depth limit
 unsigned long tackL = 1;
+// number of threads listing directories ahead of the output
+unsigned long tackJ = 4;
 // for each entry, this stores if the entry at each preceding
 // level was the last entry in that level, for formatting
 vector<bool> lastFlags;
+// device of the starting path, the walk stays on it with -x
+dev_t startDevice = 0;
+
+// all output goes through one buffer, written out whenever it fills
+const size_t outputSize = 256 * 1024;
+char outputBuffer[outputSize];
+size_t outputLength = 0;
+// with -0, the path of the directory being printed relative to the root
+string relativePath;
+// with -s a directory's line waits here, with its size left blank, until
+// its subtree has been walked. lines go straight out when nothing waits
+string pendingLines;
+unsigned long pendingSizes = 0;
+// the same units as doug, every size is sizeWidth characters
+const array<string, 5> sizeUnits { "B ", "KB", "MB", "GB", "TB" };
+const size_t sizeWidth = 8;
+
+// --exclude patterns, split by how cheaply they can be checked
+struct ExcludeMatcher {
+    // patterns without wildcards, kept sorted
+    vector<string> names;
+    // "name*" and "*name"
+    vector<string> prefixes;
+    vector<string> suffixes;
+    // anything else is left to fnmatch
+    vector<string> globs;
+    bool empty = true;
+};
+
+ExcludeMatcher excludes;
+
+// layout of the records returned by getdents64
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+};
+
+const size_t direntBufferSize = 64 * 1024;
+alignas(8) thread_local char direntBuffer[direntBufferSize];
+
+struct Entry {
+    string name;
+    bool isDirectory;
+    bool isSymlink;
+    // with -s, hidden directories are kept to be walked but not printed
+    bool shown;
+    // apparent size of a regular file
+    uint64_t size;
+};
+
+// a directory's filtered and sorted entries, filled in by the
+// prefetch workers before the printing thread gets to it
+struct Listing {
+    // children are opened relative to the parent's fd, which stays open
+    // until the printer is done with the parent. the root has no parent
+    // and its name is the path given
+    Listing* parent = nullptr;
+    string name;
+    unsigned long level = 0;
+    // reached through a symlink, so it could lead back to an ancestor
+    bool followed = false;
+    int fd = -1;
+    dev_t device = 0;
+    ino_t inode = 0;
+    vector<Entry> entries;
+    // listing for each entry that will be descended into, or null
+    vector<shared_ptr<Listing>> children;
+    // with -s, the files in this directory, then the whole subtree
+    uint64_t total = 0;
+    int error = 0;
+    enum { waiting, listing, listed } state = waiting;
+};
+
+// the printer's position in one open directory
+struct Frame {
+    shared_ptr<Listing> listing;
+    size_t cursor;
+    // length of this directory's part of relativePath
+    size_t pathLength;
+    // whether this directory's own entry was printed, and its contents are
+    bool entryShown;
+    bool contentsShown;
+    // symlinked directories are not added to their parent's size
+    bool counted;
+    // where this directory's size goes in pendingLines, or npos
+    size_t sizeOffset;
+    // the last entry that will be printed, for the formatting
+    size_t lastShown;
+    bool printedAny;
+};
+
+// directories waiting to be listed, next in output order at the front
+struct Prefetch {
+    mutex lock;
+    condition_variable changed;
+    deque<weak_ptr<Listing>> waiting;
+    // listings filled but not yet reached by the printing thread
+    unsigned long ahead = 0;
+    bool finished = false;
+};
+
+Prefetch prefetch;
+// how many listings the workers may hold ahead of the output
+const unsigned long prefetchWindow = 64;
 
 void printUsage(bool badFlag, bool badPath, string problem)
 {
@@ -25,11 +154,17 @@ void printUsage(bool badFlag, bool badPath, string problem)
         cerr << "ERROR: Unrecognized flag \"" << problem << "\"\n";
     else if(badPath)
         cerr << "ERROR: Unrecognized path \"" << problem << "\"\n";
-    cout << "Usage: trey [-adh] [-l n] [path]\n";
+    cout << "Usage: trey [-0adhsxJ] [-j n] [-l n] [--exclude pattern] [path]\n";
+    cout << "   -0 : print NUL separated relative paths\n";
     cout << "   -a : show hidden files\n";
     cout << "   -d : show directories only\n";
     cout << "   -h : show help\n";
-    cout << "   -l n : set depth to n\n";
+    cout << "   -j n : list directories ahead with n threads\n";
+    cout << "   -l n : set depth to n, 0 for no limit\n";
+    cout << "   -s : show the size of files and directories\n";
+    cout << "   -x : stay on the filesystem of path\n";
+    cout << "   -J : print the tree as JSON\n";
+    cout << "   --exclude pattern : skip entries whose name matches pattern\n";
     exit((badFlag || badPath) ? 1 : 0);
 }
 
@@ -39,10 +174,10 @@ bool isNumeric(string input) {
         if (!isdigit(input[i]))
             return false;
     }
-    return true;
+    return !input.empty();
 }
 
-int setFlags(int arg, char** argv)
+int setFlags(int argc, int arg, char** argv)
 {
     for(string::size_type charIndex = 1; 
         charIndex < string(argv[arg]).length(); charIndex++)
@@ -53,11 +188,23 @@ int setFlags(int arg, char** argv)
             tackA = true;
         else if(argv[arg][charIndex] == 'd')
             tackD = true;
-        else if(argv[arg][charIndex] == 'l')
+        else if(argv[arg][charIndex] == 'x')
+            tackX = true;
+        else if(argv[arg][charIndex] == 's')
+            tackS = true;
+        else if(argv[arg][charIndex] == 'J')
+            tackJson = true;
+        else if(argv[arg][charIndex] == '0')
+            tackZero = true;
+        else if(argv[arg][charIndex] == 'l' || argv[arg][charIndex] == 'j')
         {
-            if(!isNumeric(argv[arg + 1]))
-                printUsage(true, false, argv[arg + 1]);
-            tackL = static_cast<unsigned long>(stoi(argv[++arg]));
+            if(arg + 1 >= argc || !isNumeric(argv[arg + 1]))
+                printUsage(true, false, (arg + 1 < argc) ? argv[arg + 1] : 
+                    string(1, argv[arg][charIndex]));
+            if(argv[arg][charIndex] == 'l')
+                tackL = stoul(argv[++arg]);
+            else
+                tackJ = stoul(argv[++arg]);
             break;
         }
         else
@@ -66,6 +213,65 @@ int setFlags(int arg, char** argv)
     return arg;
 }
 
+bool hasWildcard(const string& text)
+{
+    return text.find_first_of("*?[\\") != string::npos;
+}
+
+void addExclude(const string& pattern)
+{
+    excludes.empty = false;
+    if(!hasWildcard(pattern))
+    {
+        excludes.names.push_back(pattern);
+        sort(excludes.names.begin(), excludes.names.end());
+    }
+    else if(pattern.size() > 1 && pattern.back() == '*' && 
+        !hasWildcard(pattern.substr(0, pattern.size() - 1)))
+        excludes.prefixes.push_back(pattern.substr(0, pattern.size() - 1));
+    else if(pattern.size() > 1 && pattern.front() == '*' && 
+        !hasWildcard(pattern.substr(1)))
+        excludes.suffixes.push_back(pattern.substr(1));
+    else
+        excludes.globs.push_back(pattern);
+}
+
+bool isExcluded(const char* name)
+{
+    if(excludes.empty)
+        return false;
+    const string_view text(name);
+    if(binary_search(excludes.names.begin(), excludes.names.end(), text))
+        return true;
+    for(const auto& prefix : excludes.prefixes)
+    {
+        if(text.compare(0, prefix.size(), prefix) == 0)
+            return true;
+    }
+    for(const auto& suffix : excludes.suffixes)
+    {
+        if(text.size() >= suffix.size() && 
+            text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0)
+            return true;
+    }
+    for(const auto& glob : excludes.globs)
+    {
+        if(fnmatch(glob.c_str(), name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+int setLongFlag(int argc, int arg, char** argv)
+{
+    const string flag = argv[arg];
+    if(flag == "--exclude" && arg + 1 < argc)
+        addExclude(argv[++arg]);
+    else
+        printUsage(true, false, flag);
+    return arg;
+}
+
 int getFlags(int argc, char** argv)
 {
     // if no arguments
@@ -75,9 +281,13 @@ int getFlags(int argc, char** argv)
     {
         for(int arg = 1; arg < argc; arg++)
         {
-            if(argv[arg][0] == '-')
+            if(argv[arg][0] == '-' && argv[arg][1] == '-')
+            {
+                arg = setLongFlag(argc, arg, argv);
+            }
+            else if(argv[arg][0] == '-')
             {
-                arg = setFlags(arg, argv);
+                arg = setFlags(argc, arg, argv);
             }
             // return index of first non '-' argument
             else
@@ -87,63 +297,590 @@ int getFlags(int argc, char** argv)
     }
 }
 
-bool entrySort(const filesystem::directory_entry& p1, 
-    const filesystem::directory_entry& p2) 
+// a name folded to lowercase once into the arena, with the directory
+// bit and its first bytes packed into prefix, so most comparisons are
+// a single integer compare
+struct SortKey {
+    uint64_t prefix;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t index;
+};
+
+// bytes of the folded name held in the key, below the directory bit
+const size_t keyBytes = 7;
+
+// returns the indices of count names in case-insensitive order, with any
+// isLater ones after the rest, the order the old tolower'd copies gave
+template<typename Name, typename IsLater>
+vector<uint32_t> sortOrder(size_t count, Name name, IsLater isLater)
+{
+    string arena;
+    vector<SortKey> keys(count);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        const auto text = name(i);
+        SortKey& key = keys[i];
+        key.prefix = isLater(i) ? (1ULL << 63) : 0;
+        key.offset = static_cast<uint32_t>(arena.size());
+        key.length = static_cast<uint32_t>(text.size());
+        key.index = i;
+        for(size_t c = 0; c < text.size(); c++)
+        {
+            const auto folded = static_cast<unsigned char>(
+                tolower(static_cast<unsigned char>(text[c])));
+            arena += static_cast<char>(folded);
+            if(c < keyBytes)
+                key.prefix |= static_cast<uint64_t>(folded) << (8 * (keyBytes - 1 - c));
+        }
+    }
+    const string_view folded(arena);
+    sort(keys.begin(), keys.end(), [&](const SortKey& k1, const SortKey& k2) {
+        if(k1.prefix != k2.prefix)
+            return k1.prefix < k2.prefix;
+        return folded.substr(k1.offset, k1.length) < 
+            folded.substr(k2.offset, k2.length);
+    });
+    vector<uint32_t> order(count);
+    for(size_t i = 0; i < count; i++)
+        order[i] = keys[i].index;
+    return order;
+}
+
+template<typename T>
+void applyOrder(vector<T>& items, const vector<uint32_t>& order)
 {
-    // sort directories before files
-    if(p1.is_directory() && !p2.is_directory())
-        return true;
-    else if(!p1.is_directory() && p2.is_directory())
-        return false;
-    // sort by name, case-insensitive
-    string name1 = p1.path().filename().string();
-    string name2 = p2.path().filename().string();
-    transform(name1.begin(), name1.end(), name1.begin(), ::tolower);
-    transform(name2.begin(), name2.end(), name2.begin(), ::tolower);
-    return (name1.compare(name2) < 0);
+    vector<T> sorted;
+    sorted.reserve(items.size());
+    for(const uint32_t index : order)
+        sorted.push_back(move(items[index]));
+    items.swap(sorted);
+}
+
+// directories before files, then by name, case-insensitive
+void sortEntries(vector<Entry>& entries)
+{
+    applyOrder(entries, sortOrder(entries.size(), 
+        [&](size_t i) { return string_view(entries[i].name); }, 
+        [&](size_t i) { return !entries[i].isDirectory; }));
+}
+
+void writeAll(const char* data, size_t length)
+{
+    while(length > 0)
+    {
+        const ssize_t written = write(STDOUT_FILENO, data, length);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            cerr << "ERROR: write failed: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+}
+
+void flushOutput()
+{
+    writeAll(outputBuffer, outputLength);
+    outputLength = 0;
 }
 
-void printFormatting(unsigned long depth, bool last)
+void appendOutput(string_view data)
 {
-    for(unsigned long level = 0; level < tackL - depth; level++)
+    if(outputLength + data.size() > outputSize)
     {
-        if(lastFlags[level])
-            cout << "    ";
+        flushOutput();
+        if(data.size() >= outputSize)
+        {
+            writeAll(data.data(), data.size());
+            return;
+        }
+    }
+    memcpy(outputBuffer + outputLength, data.data(), data.size());
+    outputLength += data.size();
+}
+
+void appendJsonString(string_view text)
+{
+    appendOutput("\"");
+    size_t start = 0;
+    for(size_t i = 0; i < text.size(); i++)
+    {
+        const auto c = static_cast<unsigned char>(text[i]);
+        if(c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        appendOutput(text.substr(start, i - start));
+        if(c == '"')
+            appendOutput("\\\"");
+        else if(c == '\\')
+            appendOutput("\\\\");
         else
-            cout << "|   ";
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            appendOutput(escaped);
+        }
+        start = i + 1;
+    }
+    appendOutput(text.substr(start));
+    appendOutput("\"");
+}
+
+void appendTree(string_view data)
+{
+    if(pendingSizes > 0)
+        pendingLines.append(data);
+    else
+        appendOutput(data);
+}
+
+void printFormatting(unsigned long level, bool last)
+{
+    for(unsigned long ancestor = 0; ancestor < level; ancestor++)
+    {
+        if(lastFlags[ancestor])
+            appendTree("    ");
+        else
+            appendTree("|   ");
     }
     if(last)
-        cout << "`-- ";
+        appendTree("`-- ");
     else
-        cout << "|-- ";
+        appendTree("|-- ");
+}
+
+string formatSize(uint64_t size)
+{
+    double roundedFileSize = static_cast<double>(size);
+    unsigned long unitIndex = 0;
+    for(unsigned long i = 0; i < sizeUnits.size(); i++)
+    {
+        if(roundedFileSize > 1024.0)
+        {
+            roundedFileSize /= 1024.0;
+            unitIndex++;
+        }
+        else
+            break;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%6.1f%s", roundedFileSize, 
+        sizeUnits[unitIndex].c_str());
+    return text;
+}
+
+void appendSizeMember(uint64_t size)
+{
+    appendOutput(",\"size\":");
+    appendOutput(to_string(size));
+}
+
+bool isDotEntry(const char* name)
+{
+    return name[0] == '.' && (name[1] == '\0' || 
+        (name[1] == '.' && name[2] == '\0'));
+}
+
+// returns 0, or the errno that ended the listing
+template<typename Visit>
+int readDirectory(int dirFd, Visit visit)
+{
+    while(true)
+    {
+        const long bytes = syscall(SYS_getdents64, dirFd, direntBuffer, 
+            direntBufferSize);
+        if(bytes == 0)
+            return 0;
+        if(bytes < 0)
+            return errno;
+        for(long offset = 0; offset < bytes;)
+        {
+            const auto* entry = 
+                reinterpret_cast<const LinuxDirent64*>(direntBuffer + offset);
+            offset += entry->d_reclen;
+            if(!isDotEntry(entry->d_name))
+                visit(*entry);
+        }
+    }
+}
+
+// directory symlinks are followed, like the entries they point to
+Entry makeEntry(int dirFd, const LinuxDirent64& dirent)
+{
+    Entry entry{ dirent.d_name, dirent.d_type == DT_DIR, 
+        dirent.d_type == DT_LNK, true, 0 };
+    struct stat info;
+    // -s needs the size of every regular file, symlinks count as nothing
+    if((dirent.d_type == DT_UNKNOWN || (tackS && dirent.d_type == DT_REG)) && 
+        fstatat(dirFd, dirent.d_name, &info, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        entry.isDirectory = S_ISDIR(info.st_mode);
+        entry.isSymlink = S_ISLNK(info.st_mode);
+        if(S_ISREG(info.st_mode))
+            entry.size = static_cast<uint64_t>(info.st_size);
+    }
+    if(entry.isSymlink)
+        entry.isDirectory = fstatat(dirFd, dirent.d_name, &info, 0) == 0 && 
+            S_ISDIR(info.st_mode);
+    return entry;
+}
+
+bool isAncestor(const Listing& listing)
+{
+    for(const Listing* ancestor = listing.parent; ancestor; 
+        ancestor = ancestor->parent)
+    {
+        if(ancestor->device == listing.device && ancestor->inode == listing.inode)
+            return true;
+    }
+    return false;
 }
 
-void printDirectoryContents(string path, unsigned long depth)
+void fillListing(Listing& listing)
 {
-    if(depth < 1)
+    listing.fd = openat(listing.parent ? listing.parent->fd : AT_FDCWD, 
+        listing.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat info;
+    if(listing.fd < 0 || fstat(listing.fd, &info) != 0)
+    {
+        listing.error = errno;
         return;
-    vector<filesystem::directory_entry> entries;
-    for(const auto& file : filesystem::directory_iterator(path))
+    }
+    listing.device = info.st_dev;
+    listing.inode = info.st_ino;
+    // with -x, mount points are listed but not entered, and a symlink
+    // back to an ancestor is not entered either since it would never end
+    if((tackX && listing.device != startDevice) || 
+        (listing.followed && isAncestor(listing)))
     {
-        // skip hidden files unless -a specified
-        if(!tackA && file.path().filename().string()[0] == '.')
-            continue;
+        close(listing.fd);
+        listing.fd = -1;
+        return;
+    }
+    listing.error = readDirectory(listing.fd, [&](const LinuxDirent64& dirent) {
+        // excluded subtrees cost this one name check
+        if(isExcluded(dirent.d_name))
+            return;
+        // skip hidden files unless -a specified, -s still counts them
+        const bool hidden = !tackA && dirent.d_name[0] == '.';
+        if(hidden && !tackS)
+            return;
+        Entry entry = makeEntry(listing.fd, dirent);
+        listing.total += entry.size;
         // skip files if -d specified
-        if(tackD && !file.is_directory())
+        entry.shown = !hidden && (!tackD || entry.isDirectory);
+        if(!entry.shown && !(tackS && entry.isDirectory))
+            return;
+        listing.entries.push_back(move(entry));
+    });
+    sortEntries(listing.entries);
+    listing.children.resize(listing.entries.size());
+    // -s walks past the depth limit, sizes cover the whole subtree
+    if(!tackS && tackL != 0 && listing.level + 1 >= tackL)
+        return;
+    for(unsigned long i = 0; i < listing.entries.size(); i++)
+    {
+        if(!listing.entries[i].isDirectory)
+            continue;
+        auto child = make_shared<Listing>();
+        child->parent = &listing;
+        child->name = listing.entries[i].name;
+        child->level = listing.level + 1;
+        child->followed = listing.followed || listing.entries[i].isSymlink;
+        listing.children[i] = move(child);
+    }
+}
+
+void finishListing(const shared_ptr<Listing>& listing)
+{
+    lock_guard<mutex> guard(prefetch.lock);
+    listing->state = Listing::listed;
+    prefetch.ahead++;
+    // children go to the front so the queue stays close to output order
+    for(auto child = listing->children.rbegin(); 
+        tackJ > 0 && child != listing->children.rend(); child++)
+    {
+        if(*child)
+            prefetch.waiting.push_front(*child);
+    }
+    prefetch.changed.notify_all();
+}
+
+void prefetchListings()
+{
+    unique_lock<mutex> guard(prefetch.lock);
+    while(true)
+    {
+        prefetch.changed.wait(guard, [] { return prefetch.finished || 
+            (!prefetch.waiting.empty() && prefetch.ahead < prefetchWindow); });
+        if(prefetch.finished)
+            return;
+        const shared_ptr<Listing> listing = prefetch.waiting.front().lock();
+        prefetch.waiting.pop_front();
+        // already printed, or the printing thread got to it first
+        if(!listing || listing->state != Listing::waiting)
+            continue;
+        listing->state = Listing::listing;
+        guard.unlock();
+        fillListing(*listing);
+        finishListing(listing);
+        guard.lock();
+    }
+}
+
+void awaitListing(const shared_ptr<Listing>& listing)
+{
+    unique_lock<mutex> guard(prefetch.lock);
+    // nobody has started it, so list it here rather than wait on a worker
+    if(listing->state == Listing::waiting)
+    {
+        listing->state = Listing::listing;
+        guard.unlock();
+        fillListing(*listing);
+        finishListing(listing);
+        guard.lock();
+    }
+    prefetch.changed.wait(guard, 
+        [&] { return listing->state == Listing::listed; });
+    prefetch.ahead--;
+    prefetch.changed.notify_all();
+}
+
+// only built for error messages, the walk itself never needs paths
+string listingPath(const Listing& listing)
+{
+    if(!listing.parent)
+        return listing.name;
+    const string parentPath = listingPath(*listing.parent);
+    return parentPath + (parentPath.back() == '/' ? "" : "/") + listing.name;
+}
+
+void reportError(const Listing& listing)
+{
+    if(!listing.error)
+        return;
+    // keep stdout and stderr in order when they share a terminal
+    flushOutput();
+    cerr << "ERROR: Cannot read \"" << listingPath(listing) << "\": " << 
+        strerror(listing.error) << "\n";
+}
+
+void printRoot(const Listing& root)
+{
+    if(tackZero)
+        return;
+    if(!tackJson)
+    {
+        appendOutput(root.name);
+        appendOutput("\n");
+        return;
+    }
+    appendOutput("[{\"type\":\"directory\",\"name\":");
+    appendJsonString(root.name);
+    if(root.error)
+    {
+        appendOutput(",\"error\":");
+        appendJsonString(strerror(root.error));
+    }
+    appendOutput(",\"contents\":[");
+}
+
+Frame makeFrame(shared_ptr<Listing> listing, size_t pathLength, 
+    bool entryShown, bool contentsShown, bool counted, size_t sizeOffset)
+{
+    size_t lastShown = listing->entries.size();
+    for(size_t i = listing->entries.size(); i > 0; i--)
+    {
+        if(listing->entries[i - 1].shown)
+        {
+            lastShown = i - 1;
+            break;
+        }
+    }
+    return Frame{ move(listing), 0, pathLength, entryShown, contentsShown, 
+        counted, sizeOffset, lastShown, false };
+}
+
+// child is the listing walked under this entry, if any. returns where
+// the directory's size is to be filled in once it is known
+size_t printEntry(Frame& frame, unsigned long level, size_t i, 
+    const Listing* child, bool contentsShown)
+{
+    const Listing& listing = *frame.listing;
+    const Entry& entry = listing.entries[i];
+    const bool first = !frame.printedAny;
+    frame.printedAny = true;
+    size_t sizeOffset = string::npos;
+    if(tackZero)
+    {
+        relativePath.resize(frame.pathLength);
+        appendOutput(relativePath);
+        appendOutput(entry.name);
+        appendOutput(string_view("\0", 1));
+    }
+    else if(tackJson)
+    {
+        appendOutput(first ? "\n" : ",\n");
+        appendOutput(entry.isDirectory ? "{\"type\":\"directory\",\"name\":" : 
+            "{\"type\":\"file\",\"name\":");
+        appendJsonString(entry.name);
+        if(child && child->error)
+        {
+            appendOutput(",\"error\":");
+            appendJsonString(strerror(child->error));
+        }
+        // a directory's object stays open until its frame is popped
+        if(contentsShown)
+            appendOutput(",\"contents\":[");
+        else if(!child)
+        {
+            if(tackS)
+                appendSizeMember(entry.size);
+            appendOutput("}");
+        }
+    }
+    else
+    {
+        const bool last = (i == frame.lastShown);
+        lastFlags[level] = last;
+        // this line and everything after it wait for the directory's size
+        if(tackS && child)
+            pendingSizes++;
+        printFormatting(level, last);
+        if(tackS)
+        {
+            appendTree("[");
+            if(child)
+            {
+                sizeOffset = pendingLines.size();
+                appendTree(string(sizeWidth, ' '));
+            }
+            else
+                appendTree(formatSize(entry.size));
+            appendTree("] ");
+        }
+        appendTree(entry.name);
+        appendTree("\n");
+    }
+    return sizeOffset;
+}
+
+void finishFrame(vector<Frame>& stack)
+{
+    const Frame& frame = stack.back();
+    const Listing& listing = *frame.listing;
+    if(tackJson && !tackZero && frame.entryShown)
+    {
+        if(frame.contentsShown)
+            appendOutput(frame.printedAny ? "\n]" : "]");
+        if(tackS)
+            appendSizeMember(listing.total);
+        appendOutput("}");
+    }
+    if(frame.sizeOffset != string::npos)
+    {
+        pendingLines.replace(frame.sizeOffset, sizeWidth, formatSize(listing.total));
+        // once the outermost waiting directory is known it all goes out
+        if(--pendingSizes == 0)
+        {
+            appendOutput(pendingLines);
+            pendingLines.clear();
+        }
+    }
+    if(stack.size() > 1)
+    {
+        if(frame.counted)
+            stack[stack.size() - 2].listing->total += listing.total;
+    }
+    else if(tackS && !tackJson && !tackZero)
+    {
+        appendOutput("[");
+        appendOutput(formatSize(listing.total));
+        appendOutput("] total\n");
+    }
+    // every child has been opened by now
+    if(listing.fd >= 0)
+        close(listing.fd);
+    stack.pop_back();
+}
+
+void printDirectoryContents(shared_ptr<Listing> root)
+{
+    awaitListing(root);
+    reportError(*root);
+    printRoot(*root);
+    vector<Frame> stack;
+    stack.push_back(makeFrame(move(root), 0, true, true, true, string::npos));
+    while(!stack.empty())
+    {
+        Frame& frame = stack.back();
+        Listing& listing = *frame.listing;
+        if(frame.cursor == listing.entries.size())
+        {
+            finishFrame(stack);
             continue;
-        entries.push_back(file);
+        }
+        const size_t i = frame.cursor++;
+        const unsigned long level = stack.size() - 1;
+        if(lastFlags.size() < stack.size())
+            lastFlags.resize(stack.size());
+        const Entry& entry = listing.entries[i];
+        const bool entryShown = frame.contentsShown && entry.shown;
+        // moving it out also drops it from the prefetch queue once printed
+        shared_ptr<Listing> child = move(listing.children[i]);
+        // with -s, directories past the depth limit are walked unprinted
+        const bool contentsShown = child && entryShown && 
+            (tackL == 0 || level + 1 < tackL);
+        if(child)
+        {
+            awaitListing(child);
+            if(entryShown)
+                reportError(*child);
+        }
+        const size_t sizeOffset = entryShown ? 
+            printEntry(frame, level, i, child.get(), contentsShown) : string::npos;
+        if(!child)
+            continue;
+        if(tackZero && contentsShown)
+        {
+            relativePath.resize(frame.pathLength);
+            relativePath += entry.name;
+            relativePath += '/';
+        }
+        const size_t pathLength = frame.pathLength + entry.name.size() + 1;
+        stack.push_back(makeFrame(move(child), pathLength, entryShown, 
+            contentsShown, !entry.isSymlink, sizeOffset));
     }
-    sort(entries.begin(), entries.end(), entrySort);
-    // recurse through directories
-    for(unsigned long i = 0; i < entries.size(); i++)
+}
+
+void printTree(const string& path)
+{
+    // every directory on the stack and in the prefetch window holds an fd
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
     {
-        const bool last = (i == (entries.size() - 1));
-        lastFlags[tackL - depth] = last;
-        printFormatting(depth, last);
-        cout << entries[i].path().filename().string() << "\n";
-        if(entries[i].is_directory())
-            printDirectoryContents(entries[i].path().string(), depth - 1);
-    }    
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    auto root = make_shared<Listing>();
+    root->name = path;
+    vector<thread> workers;
+    for(unsigned long j = 0; j < tackJ; j++)
+        workers.emplace_back(prefetchListings);
+    printDirectoryContents(move(root));
+    {
+        lock_guard<mutex> guard(prefetch.lock);
+        prefetch.finished = true;
+    }
+    prefetch.changed.notify_all();
+    for(auto& worker : workers)
+        worker.join();
+    if(tackJson)
+        appendOutput("\n]\n");
+    flushOutput();
 }
 
 int main(int argc, char** argv)
@@ -152,10 +889,13 @@ int main(int argc, char** argv)
     const string path = (pathIndex == -1) ? 
         filesystem::current_path().string() : 
         static_cast<string>(argv[pathIndex]);
-    if (!filesystem::exists(path))
+    struct stat pathInfo;
+    if (!filesystem::exists(path) || stat(path.c_str(), &pathInfo) != 0)
         printUsage(false, true, path);
-    lastFlags.resize(static_cast<unsigned long>(tackL));
-    cout << path << "\n";
-    printDirectoryContents(path, tackL);
+    startDevice = pathInfo.st_dev;
+    // -0 output has nowhere to put sizes
+    if(tackZero)
+        tackS = false;
+    printTree(path);
     return 0;
 }
\ No newline at end of file